@@ -437,6 +437,9 @@ lval* lval_copy(lval* v) {
   return x;
 }
 
+/* Tag IDs of the grammar rules, looked up once in main */
+int tag_number, tag_symbol, tag_sexpr, tag_qexpr;
+
 lval* lval_read_num(mpc_ast_t* t) {
   errno = 0;
   long x = strtol(t->contents, NULL, 10);
@@ -446,14 +449,14 @@ lval* lval_read_num(mpc_ast_t* t) {
 lval* lval_read(mpc_ast_t* t) {
 
   /* If Symbol or Number, return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  if (mpc_ast_has_tag(t, tag_number)) { return lval_read_num(t); }
+  if (mpc_ast_has_tag(t, tag_symbol)) { return lval_sym(t->contents); }
 
   /* If too (>) or sexpr, then create empty list */
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  if (mpc_ast_tag_is(t, MPC_TAG_ROOT)) { x = lval_sexpr(); }
+  if (mpc_ast_has_tag(t, tag_sexpr))  { x = lval_sexpr(); }
+  if (mpc_ast_has_tag(t, tag_qexpr))  { x = lval_qexpr(); }
 
   /* Fill this list with any valid expression contained within */
   for (int i = 0; i < t->children_num; i++) {
@@ -461,7 +464,7 @@ lval* lval_read(mpc_ast_t* t) {
     if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
     if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
     if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+    if (mpc_ast_tag_is(t->children[i], MPC_TAG_REGEX)) { continue; }
     x = lval_add(x, lval_read(t->children[i]));
   }
 
@@ -1059,6 +1062,11 @@ int main (int argc, char** argv) {
     ",
             Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 
+  tag_number = mpc_tag(Number);
+  tag_symbol = mpc_tag(Symbol);
+  tag_sexpr = mpc_tag(Sexpr);
+  tag_qexpr = mpc_tag(Qexpr);
+
 
   /* Print Version and Exit Information */
   puts("Lispy Version 0.9");
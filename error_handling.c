@@ -90,12 +90,16 @@ void lval_println(lval v) {
 
 int number_of_nodes(mpc_ast_t* t) {
   if (t->children_num == 0) {
-    printf("Node %s with: %s\n", t->tag, t->contents);
+    printf("Node ");
+    mpc_ast_print_tag_to(t, stdout);
+    printf(" with: %s\n", t->contents);
     return 1;
   }
   if (t->children_num >= 1) {
     int total = 1;
-    printf("Node %s has %d children. Recursing...\n", t->tag, t->children_num);
+    printf("Node ");
+    mpc_ast_print_tag_to(t, stdout);
+    printf(" has %d children. Recursing...\n", t->children_num);
     for (int i = 0; i < t->children_num; i++) {
       total += number_of_nodes(t->children[i]);
     }
@@ -124,10 +128,13 @@ lval eval_op(lval x, char* op, lval y) {
   return lval_err(LERR_BAD_OP);
 }
 
+/* Tag IDs of the grammar rules, looked up once in main */
+int tag_number, tag_expr;
+
 lval eval(mpc_ast_t* t) {
 
   /* If tagged as number return it directly */
-  if (strstr(t->tag, "number")) {
+  if (mpc_ast_has_tag(t, tag_number)) {
     /* Check if there is some error in conversion */
     errno = 0;
     long x = strtol(t->contents, NULL, 10);
@@ -142,7 +149,7 @@ lval eval(mpc_ast_t* t) {
 
   /* Iterate the remaining children and combining */
   int i = 3;
-  while (strstr(t->children[i]->tag, "expr")) {
+  while (mpc_ast_has_tag(t->children[i], tag_expr)) {
     x = eval_op(x, op, eval(t->children[i]));
     i++;
   }
@@ -167,6 +174,9 @@ int main (int argc, char** argv) {
     ",
             Number, Operator, Expr, Lispy);
 
+  tag_number = mpc_tag(Number);
+  tag_expr = mpc_tag(Expr);
+
 
   /* Print Version and Exit Information */
   puts("Lispy Vewrsion 0.1");
@@ -29,12 +29,16 @@ void add_history(char* unused) {}
 
 int number_of_nodes(mpc_ast_t* t) {
   if (t->children_num == 0) {
-    printf("Node %s with: %s\n", t->tag, t->contents);
+    printf("Node ");
+    mpc_ast_print_tag_to(t, stdout);
+    printf(" with: %s\n", t->contents);
     return 1;
   }
   if (t->children_num >= 1) {
     int total = 1;
-    printf("Node %s has %d children. Recursing...\n", t->tag, t->children_num);
+    printf("Node ");
+    mpc_ast_print_tag_to(t, stdout);
+    printf(" has %d children. Recursing...\n", t->children_num);
     for (int i = 0; i < t->children_num; i++) {
       total += number_of_nodes(t->children[i]);
     }
@@ -51,10 +55,13 @@ long eval_op(long x, char* op, long y) {
   return 0;
 }
 
+/* Tag IDs of the grammar rules, looked up once in main */
+int tag_number, tag_expr;
+
 long eval(mpc_ast_t* t) {
 
   /* If tagged as number return it directly */
-  if (strstr(t->tag, "number")) {
+  if (mpc_ast_has_tag(t, tag_number)) {
     return atoi(t->contents);
   }
 
@@ -66,7 +73,7 @@ long eval(mpc_ast_t* t) {
 
   /* Iterate the remaining children and combining */
   int i = 3;
-  while (strstr(t->children[i]->tag, "expr")) {
+  while (mpc_ast_has_tag(t->children[i], tag_expr)) {
     x = eval_op(x, op, eval(t->children[i]));
     i++;
   }
@@ -91,6 +98,9 @@ int main (int argc, char** argv) {
     ",
             Number, Operator, Expr, Lispy);
 
+  tag_number = mpc_tag(Number);
+  tag_expr = mpc_tag(Expr);
+
 
   /* Print Version and Exit Information */
   puts("Lispy Vewrsion 0.1");
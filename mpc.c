@@ -1,5 +1,21 @@
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
+
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MPC_USE_MMAP
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 /*
 ** State Type
 */
@@ -27,8 +43,8 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 /*
-** In mpc the input type has three modes of
-** operation: String, File and Pipe.
+** In mpc the input type has four modes of
+** operation: String, File, Pipe and Mmap.
 **
 ** String is easy. The whole contents are
 ** loaded into a buffer and scanned through.
@@ -40,16 +56,22 @@ static mpc_state_t mpc_state_new(void) {
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** The third mode is Pipe. This is the difficult
+** one. As we assume pipes cannot be seeked, all
+** input is read through a ring buffer which keeps
+** everything from the oldest mark onwards, or from
+** the current position when nothing is marked.
 **
 ** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** back we can simply read from the buffer again,
+** while anything before the oldest mark is dropped
+** and its space reused.
+**
+** Mmap is used for files where it is available.
+** The file is mapped read-only and then read
+** exactly as a String is, without copying it.
+** Files which are not regular or cannot be
+** mapped fall back to the File and Pipe modes.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -60,13 +82,18 @@ static mpc_state_t mpc_state_new(void) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
 };
 
 enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+enum {
+  MPC_INPUT_BUFFER_MIN = 4096
+};
+
 enum {
   MPC_INPUT_MEM_NUM = 512
 };
@@ -85,6 +112,14 @@ typedef struct {
   char *buffer;
   FILE *file;
 
+  size_t buffer_slots;
+  long buffer_pos;
+  long buffer_end;
+
+  char *map;
+  size_t map_size;
+  long map_pos;
+
   int suppress;
   int backtrack;
   int marks_slots;
@@ -171,9 +206,13 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->buffer = malloc(MPC_INPUT_BUFFER_MIN);
   i->file = pipe;
 
+  i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+  i->buffer_pos = 0;
+  i->buffer_end = 0;
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -216,12 +255,97 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   return i;
 }
 
+/*
+** Maps the rest of a regular file, starting from its current
+** position, followed by at least one zero byte so the contents
+** end like a String. Anything else is read as a File or Pipe.
+*/
+
+static mpc_input_t *mpc_input_new_mmap(const char *filename, FILE *file) {
+
+#ifdef MPC_USE_MMAP
+  mpc_input_t *i;
+  struct stat st;
+  long pos = ftell(file);
+  long page = sysconf(_SC_PAGESIZE);
+  size_t size;
+  char *map;
+
+  if (pos < 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return mpc_input_new_pipe(filename, file);
+  }
+
+  /* A stream already past the end of the file has nothing to map */
+  if (pos > st.st_size) { return mpc_input_new_file(filename, file); }
+
+  /* Reserve zeroed pages, then map the file over the start of them */
+  size = ((size_t)st.st_size / page + 1) * page;
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) { return mpc_input_new_file(filename, file); }
+
+  if (st.st_size > 0
+  &&  mmap(map, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+           fileno(file), 0) == MAP_FAILED) {
+    munmap(map, size);
+    return mpc_input_new_file(filename, file);
+  }
+
+  i = malloc(sizeof(mpc_input_t));
+
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_MMAP;
+
+  i->state = mpc_state_new();
+
+  i->string = map + pos;
+  i->buffer = NULL;
+  i->file = file;
+
+  i->map = map;
+  i->map_size = size;
+  i->map_pos = pos;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+  i->mem_index = 0;
+  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+
+  return i;
+#else
+  return mpc_input_new_file(filename, file);
+#endif
+
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  long j;
+
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+
+  /* Give back to the pipe what was read ahead but not consumed */
+  if (i->type == MPC_INPUT_PIPE) {
+    for (j = i->buffer_end - 1; j >= i->state.pos; j--) {
+      ungetc(i->buffer[j & (i->buffer_slots-1)], i->file);
+    }
+    free(i->buffer);
+  }
+#ifdef MPC_USE_MMAP
+  /* Leave the file just after what was consumed, as reading would */
+  if (i->type == MPC_INPUT_MMAP) {
+    fseek(i->file, i->map_pos + i->state.pos, SEEK_SET);
+    munmap(i->map, i->map_size);
+  }
+#endif
 
   free(i->marks);
   free(i->lasts);
@@ -313,14 +437,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,14 +454,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -359,12 +470,40 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+static char mpc_input_buffer_get(mpc_input_t *i) {
+  return i->buffer[i->state.pos & (i->buffer_slots-1)];
 }
 
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+/*
+** Reads the next character of a pipe into the buffer, first
+** dropping what is behind both the oldest mark and the current
+** position. The buffer only doubles when all it holds is needed.
+*/
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+
+  int c = getc(i->file);
+  long j, start;
+  char *buffer;
+
+  if (c == EOF) { return 0; }
+
+  start = i->marks_num ? i->marks[0].pos : i->state.pos;
+  if (start > i->buffer_pos) { i->buffer_pos = start; }
+
+  if (i->buffer_end - i->buffer_pos == (long)i->buffer_slots) {
+    buffer = malloc(i->buffer_slots * 2);
+    for (j = i->buffer_pos; j < i->buffer_end; j++) {
+      buffer[j & (i->buffer_slots*2-1)] = i->buffer[j & (i->buffer_slots-1)];
+    }
+    free(i->buffer);
+    i->buffer = buffer;
+    i->buffer_slots *= 2;
+  }
+
+  i->buffer[i->buffer_end & (i->buffer_slots-1)] = c;
+  i->buffer_end++;
+  return 1;
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -373,19 +512,15 @@ static char mpc_input_getc(mpc_input_t *i) {
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return i->string[i->state.pos];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
+      if (i->state.pos == i->buffer_end && !mpc_input_buffer_fill(i)) {
+        return EOF;
       }
+      return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -396,7 +531,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return i->string[i->state.pos];
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -407,21 +543,10 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
+      if (i->state.pos == i->buffer_end && !mpc_input_buffer_fill(i)) {
+        return '\0';
       }
+      return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -434,19 +559,12 @@ static int mpc_input_terminated(mpc_input_t *i) {
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
+  (void)c;
   switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+    case MPC_INPUT_PIPE: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
     default: { break; }
   }
   return 0;
@@ -454,13 +572,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -1370,7 +1481,7 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
 
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  mpc_input_t *i = mpc_input_new_mmap(filename, file);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -2932,6 +3043,55 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Tag names are interned into a global table so that every AST node
+** can store its tag path as a few small integers. The first few IDs are
+** fixed and match the MPC_TAG_* constants in the header.
+*/
+
+static const char *mpc_tag_fixed[] = { ">", "string", "char", "regex" };
+static char **mpc_tag_names = NULL;
+static int mpc_tag_names_num = 0;
+
+#define MPC_TAG_FIXED_NUM ((int)(sizeof(mpc_tag_fixed) / sizeof(mpc_tag_fixed[0])))
+
+static int mpc_tag_id_n(const char *t, size_t n) {
+
+  int i;
+
+  for (i = 0; i < MPC_TAG_FIXED_NUM; i++) {
+    if (strlen(mpc_tag_fixed[i]) == n && strncmp(mpc_tag_fixed[i], t, n) == 0) { return i; }
+  }
+
+  for (i = 0; i < mpc_tag_names_num; i++) {
+    if (strlen(mpc_tag_names[i]) == n && strncmp(mpc_tag_names[i], t, n) == 0) { return MPC_TAG_FIXED_NUM + i; }
+  }
+
+  mpc_tag_names_num++;
+  mpc_tag_names = realloc(mpc_tag_names, sizeof(char*) * mpc_tag_names_num);
+  mpc_tag_names[mpc_tag_names_num-1] = malloc(n + 1);
+  memcpy(mpc_tag_names[mpc_tag_names_num-1], t, n);
+  mpc_tag_names[mpc_tag_names_num-1][n] = '\0';
+
+  return MPC_TAG_FIXED_NUM + mpc_tag_names_num - 1;
+}
+
+int mpc_tag_id(const char *t) {
+  return mpc_tag_id_n(t, strlen(t));
+}
+
+const char *mpc_tag_name(int id) {
+  if (id >= 0 && id < MPC_TAG_FIXED_NUM) { return mpc_tag_fixed[id]; }
+  if (id >= MPC_TAG_FIXED_NUM && id < MPC_TAG_FIXED_NUM + mpc_tag_names_num) {
+    return mpc_tag_names[id - MPC_TAG_FIXED_NUM];
+  }
+  return "";
+}
+
+int mpc_tag(mpc_parser_t *p) {
+  return p->name ? mpc_tag_id(p->name) : -1;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
@@ -2943,7 +3103,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
 
   free(a->children);
-  free(a->tag);
+  free(a->tags);
   free(a->contents);
   free(a);
 
@@ -2951,17 +3111,44 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
-  free(a->tag);
+  free(a->tags);
   free(a->contents);
   free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+/*
+** Tags are stored innermost first so that wrapping a node in
+** another rule is an append rather than a shift.
+*/
+
+static void mpc_ast_push_tag_id(mpc_ast_t *a, int id) {
+  if (a->tags_num == a->tags_max) {
+    a->tags_max = a->tags_max ? a->tags_max * 2 : 4;
+    a->tags = realloc(a->tags, sizeof(int) * a->tags_max);
+  }
+  a->tags[a->tags_num++] = id;
+}
+
+/* Push the '|' separated tags of `t` from the innermost out */
+static void mpc_ast_push_tags(mpc_ast_t *a, const char *t) {
+  const char *e = t + strlen(t);
+  const char *s;
+  while (e > t) {
+    s = e;
+    while (s > t && *(s-1) != '|') { s--; }
+    if (e > s) { mpc_ast_push_tag_id(a, mpc_tag_id_n(s, e - s)); }
+    e = s > t ? s - 1 : t;
+  }
+}
+
+static mpc_ast_t *mpc_ast_new_id(int id, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tags = NULL;
+  a->tags_num = 0;
+  a->tags_max = 0;
+  if (id >= 0) { mpc_ast_push_tag_id(a, id); }
 
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
@@ -2974,6 +3161,12 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  mpc_ast_t *a = mpc_ast_new_id(-1, contents);
+  mpc_ast_push_tags(a, tag);
+  return a;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -3000,7 +3193,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_id(MPC_TAG_ROOT, "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -3009,7 +3202,10 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tags_num != b->tags_num) { return 0; }
+  for (i = 0; i < a->tags_num; i++) {
+    if (a->tags[i] != b->tags[i]) { return 0; }
+  }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
 
@@ -3029,27 +3225,88 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  mpc_ast_push_tags(a, t);
+  return a;
+}
+
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id) {
+  if (a == NULL) { return a; }
+  mpc_ast_push_tag_id(a, id);
+  return a;
+}
+
+/*
+** Moves the tags of a collapsed parent `r` onto its only child, leaving
+** out the root marker the parent was given when it was folded.
+*/
+
+static mpc_ast_t *mpc_ast_add_root_tags(mpc_ast_t *a, mpc_ast_t *r) {
+  int i = (r->tags_num && r->tags[0] == MPC_TAG_ROOT) ? 1 : 0;
+  if (a == NULL) { return a; }
+  for (; i < r->tags_num; i++) { mpc_ast_push_tag_id(a, r->tags[i]); }
   return a;
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  mpc_ast_t *r;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  r = mpc_ast_new(t, "");
+  mpc_ast_add_root_tags(a, r);
+  mpc_ast_delete(r);
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  a->tags_num = 0;
+  mpc_ast_push_tags(a, t);
   return a;
 }
 
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, int id) {
+  a->tags_num = 0;
+  mpc_ast_push_tag_id(a, id);
+  return a;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+  int i;
+  for (i = 0; i < a->tags_num; i++) {
+    if (a->tags[i] == id) { return 1; }
+  }
+  return 0;
+}
+
+int mpc_ast_tag_is(mpc_ast_t *a, int id) {
+  return a->tags_num == 1 && a->tags[0] == id;
+}
+
+int mpc_ast_tag_eq(mpc_ast_t *a, const char *t) {
+
+  int i;
+  size_t n;
+  const char *name;
+
+  for (i = a->tags_num-1; i >= 0; i--) {
+    name = mpc_tag_name(a->tags[i]);
+    n = strlen(name);
+    if (strncmp(t, name, n) != 0) { return 0; }
+    t += n;
+    if (i > 0) {
+      if (*t != '|') { return 0; }
+      t++;
+    }
+  }
+
+  return *t == '\0';
+}
+
+void mpc_ast_print_tag_to(mpc_ast_t *a, FILE *fp) {
+  int i;
+  for (i = a->tags_num-1; i >= 0; i--) {
+    fprintf(fp, i > 0 ? "%s|" : "%s", mpc_tag_name(a->tags[i]));
+  }
+}
+
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
   a->state = s;
@@ -3067,13 +3324,15 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
+  mpc_ast_print_tag_to(a, fp);
+
   if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+    fprintf(fp, ":%lu:%lu '%s'\n",
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
       a->contents);
   } else {
-    fprintf(fp, "%s \n", a->tag);
+    fprintf(fp, " \n");
   }
 
   for (i = 0; i < a->children_num; i++) {
@@ -3098,7 +3357,7 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(mpc_ast_tag_eq(ast->children[i], tag)) {
       return i;
     }
   }
@@ -3114,7 +3373,7 @@ mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(mpc_ast_tag_eq(ast->children[i], tag)) {
       return ast->children[i];
     }
   }
@@ -3269,7 +3528,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_id(MPC_TAG_ROOT, "");
 
   for (i = 0; i < n; i++) {
 
@@ -3278,7 +3537,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_add_child(r, mpc_ast_add_root_tags(as[i]->children[0], as[i]));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
@@ -3315,12 +3574,25 @@ mpc_parser_t *mpca_state(mpc_parser_t *a) {
   return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
 
+/*
+** Tag names are interned when the parser is built, so applying
+** a tag while parsing only appends an integer to the node.
+*/
+
+static mpc_val_t *mpcf_ast_tag_id(mpc_val_t *x, void *t) {
+  return mpc_ast_tag_id(x, (int)(size_t)t);
+}
+
+static mpc_val_t *mpcf_ast_add_tag_id(mpc_val_t *x, void *t) {
+  return mpc_ast_add_tag_id(x, (int)(size_t)t);
+}
+
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return mpc_apply_to(a, mpcf_ast_tag_id, (void*)(size_t)mpc_tag_id(t));
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+  return mpc_apply_to(a, mpcf_ast_add_tag_id, (void*)(size_t)mpc_tag_id(t));
 }
 
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
@@ -3805,7 +4077,7 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
   st.parsers = NULL;
   st.flags = flags;
 
-  i = mpc_input_new_file("<mpca_lang_file>", f);
+  i = mpc_input_new_mmap("<mpca_lang_file>", f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
 
@@ -3881,7 +4153,7 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
 
-  i = mpc_input_new_file(filename, f);
+  i = mpc_input_new_mmap(filename, f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
 
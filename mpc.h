@@ -282,8 +282,26 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** Each node carries its tag path as interned tag IDs, innermost first.
+** The usual "expr|number|regex" string is only built for printing.
+*/
+
+enum {
+  MPC_TAG_ROOT   = 0,
+  MPC_TAG_STRING = 1,
+  MPC_TAG_CHAR   = 2,
+  MPC_TAG_REGEX  = 3
+};
+
+int mpc_tag_id(const char *t);
+const char *mpc_tag_name(int id);
+int mpc_tag(mpc_parser_t *p);
+
 typedef struct mpc_ast_t {
-  char *tag;
+  int *tags;
+  int tags_num;
+  int tags_max;
   char *contents;
   mpc_state_t state;
   int children_num;
@@ -297,11 +315,18 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id);
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, int id);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
+void mpc_ast_print_tag_to(mpc_ast_t *a, FILE *fp);
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+int mpc_ast_tag_is(mpc_ast_t *a, int id);
+int mpc_ast_tag_eq(mpc_ast_t *a, const char *t);
 
 int mpc_ast_get_index(mpc_ast_t *ast, const char *tag);
 int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb);
@@ -1,5 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+/* Build with -DLISPY_GC to manage memory with a tracing mark and sweep */
+/* collector instead of reference counts. Setting LISPY_GC_VERBOSE in   */
+/* the environment reports every collection, and LISPY_GC_THRESHOLD    */
+/* sets the minimum number of allocations between collections.         */
+
+/* Build with -DLISPY_NO_SLAB to allocate every object with malloc,     */
+/* which helps memory checkers. Setting LISPY_ALLOC_STATS reports how  */
+/* often the slab allocator's free lists were hit on exit.             */
 
 /* --- Error reporting macros ---*/
 #define LASSERT(args, cond, fmt, ...) \
@@ -10,9 +22,9 @@
   }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, LTYPE(args->cell[index]) == expect, \
           "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-          func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+          func, index, ltype_name(LTYPE(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM_ARGS(func, args, num) \
   LASSERT(args, args->count == num, \
@@ -24,6 +36,32 @@
           "Function '%s' passed {} for argument %i.", \
           func, index)
 
+/* As above for builtins borrowing their arguments, which are not freed */
+#define LCHECK(cond, fmt, ...) \
+  if (!(cond)) { return lval_err(fmt, ##__VA_ARGS__); }
+
+#define LCHECK_TYPE(func, argv, index, expect) \
+  LCHECK(LTYPE(argv[index]) == expect, \
+         "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+         func, index, ltype_name(LTYPE(argv[index])), ltype_name(expect))
+
+#define LCHECK_NUM_ARGS(func, argc, num) \
+  LCHECK(argc == num, \
+         "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+         func, argc, num)
+
+#define LCHECK_NOT_EMPTY(func, argv, index)    \
+  LCHECK(argv[index]->count != 0,        \
+         "Function '%s' passed {} for argument %i.", \
+         func, index)
+
+/* Keys of maps are numbers, strings and symbols */
+#define LCHECK_KEY(func, argv, index) \
+  LCHECK(LINT_P(argv[index]) || LTYPE(argv[index]) == LVAL_STR \
+         || LTYPE(argv[index]) == LVAL_SYM, \
+         "Function '%s' passed incorrect type for argument %i. " \
+         "Got %s, Expected Number, String or Symbol.", \
+         func, index, ltype_name(LTYPE(argv[index])))
 
 #include "mpc.h"
 
@@ -54,9 +92,23 @@ void add_history(char* unused) {}
 /* --- Type declarations --- */
 struct lval;
 struct lenv;
+struct lcode;
+struct lsym;
+struct lmemo;
+struct lmap;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lsym lsym;
+typedef struct lmemo lmemo;
+typedef struct lmap lmap;
 
+/* Builtins are given the argc arguments at argv, which the evaluator */
+/* owns. argv is only valid until the builtin evaluates anything, as  */
+/* the value stack holding it may move.                              */
+typedef lval*(*lprim)(lenv*, int, lval**);
+
+/* Builtins of the older kind take ownership of an argument list */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 typedef enum {
@@ -66,125 +118,565 @@ typedef enum {
   LVAL_STR,
   LVAL_FUN,
   LVAL_SEXPR,
-  LVAL_QEXPR
+  LVAL_QEXPR,
+  LVAL_MAP,
+  LVAL_VEC,
+  LVAL_DBL,
+  LVAL_BIG
 } lval_t;
 
+/* Operators of the arithmetic and comparison builtins */
+typedef enum {
+  LOPR_ADD, LOPR_SUB, LOPR_MUL, LOPR_DIV,
+  LOPR_GT, LOPR_LT, LOPR_GE, LOPR_LE,
+  LOPR_EQ, LOPR_NE
+} lopr_t;
+
 typedef enum {
   LERR_DIV_ZERO,
   LERR_BAD_OP,
   LERR_BAD_NUM
 } err_t;
 
+/* Interned symbol name, unique for each name and never freed */
+struct lsym {
+  char* name;
+  unsigned long hash;
+  int frames;     /* Number of live non-global frames binding it */
+  lsym* next;
+};
+
+/* Values are immutable once shared, and are shared by reference count. */
+/* lval_copy takes another reference and lval_del drops one, so code   */
+/* which changes a value in place must first make it its own with      */
+/* lval_own. When built with LISPY_GC refs only records whether a      */
+/* value has ever been shared, and the collector frees it.             */
 struct lval {
   lval_t type;
+  int refs;
 
-  /* Basic */
-  long num;
-  char* err;
-  char* sym;
-  char* str;
-
-  /* Functions */
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+#ifdef LISPY_GC
+  /* Collector bookkeeping */
+  int mark;
+  lval* next;
+#endif
 
-  /* Expression */
-  int count;
-  struct lval** cell;
+  /* Only the fields of the value's type are in use */
+  union {
+    /* Basic */
+    long num;
+    double dbl;
+    char* err;
+    lsym* sym;
+    char* str;
+    lmap* map;
+
+    /* Functions */
+    struct {
+      lprim prim;
+      lbuiltin builtin;
+      lenv* env;
+      lval* formals;
+      lval* body;
+      union {
+        lcode* code;
+
+        /* Functions made by 'memo' cache the results of calling */
+        /* their body here, and are called as builtins           */
+        lmemo* memo;
+      };
+    };
+
+    /* Expression, Vector of count numbers held unboxed, or Bignum */
+    struct {
+      int count;
+      int floats;     /* Vector holds dbls rather than nums */
+      union {
+        struct lval** cell;
+        long* nums;
+        double* dbls;
+        uint32_t* limbs;
+      };
+    };
+  };
 };
 
+/* Numbers which fit are stored in the pointer itself rather than     */
+/* allocated, marked by setting its lowest bit. Such a fixnum has no  */
+/* fields, so the type and number of any value are read through      */
+/* LTYPE and LNUM.                                                   */
+#define LFIX_P(v) ((uintptr_t)(v) & 1)
+#define LFIX_MIN (INTPTR_MIN >> 1)
+#define LFIX_MAX (INTPTR_MAX >> 1)
+#define LTYPE(v) (LFIX_P(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LFIX_P(v) ? (long)((intptr_t)(v) >> 1) : (v)->num)
+
+/* Integers outside the range of long are Bignums, holding abs(count) */
+/* 32 bit limbs of the magnitude, least significant first, with count */
+/* negative for negative numbers. Integers which fit are always made  */
+/* Numbers, so the two types never hold the same value.              */
+#define LINT_P(v) (LTYPE(v) == LVAL_NUM || LTYPE(v) == LVAL_BIG)
+
+/* Check if v is a Number, Bignum or Float, and read any as a double */
+#define LNUMERIC_P(v) (LINT_P(v) || LTYPE(v) == LVAL_DBL)
+#define LDBL(v) (LTYPE(v) == LVAL_DBL ? (v)->dbl \
+                 : LTYPE(v) == LVAL_BIG ? lbig_dbl(v) : (double)LNUM(v))
+
+/* Limbs of an unsigned long, and the magnitudes from which */
+/* multiplication switches to Karatsuba's method            */
+#define LBIG_LONG_LIMBS (int)(sizeof(unsigned long) / sizeof(uint32_t))
+#define LBIG_KARATSUBA 32
+
+/* Check if function v is a builtin rather than a lambda */
+#define LBUILTIN_P(v) ((v)->prim || (v)->builtin)
+
+/* Check if builtin v is a memoized function */
+#define LMEMO_P(v) ((v)->prim == builtin_memoized)
+
+/* Environments larger than this are indexed by a hash table */
+#define LENV_SMALL 8
+
+/* Environments are shared by reference count, as closures keep the  */
+/* frame they were created in. par is the lexically enclosing frame,  */
+/* or NULL when that is the global environment, while dyn is the      */
+/* frame of the caller and only valid while the call is running.      */
 struct lenv {
+  int refs;
   lenv* par;
+  lenv* dyn;
+
+  /* Set once '=' binds in this frame, so formals of enclosing lambdas */
+  /* may be shadowed and are no longer found at a fixed depth          */
+  int extended;
+
+  int count;
+  int cap;
+  lsym** syms;
+  lval** vals;
+
+  /* Open addressing table of entry index + 1, or 0 for empty slots */
+  int size;
+  int* table;
+
+#ifdef LISPY_GC
+  int mark;
+  lenv* next;
+#endif
+};
+
+/* --- Bytecode --- */
+typedef enum {
+  OP_CONST,   /* k:           push copy of constant k                 */
+  OP_LOAD,    /* k cache:     push value bound to symbol constant k   */
+  OP_LOCAL,   /* d slot k:    push formal slot of frame d levels out  */
+  OP_CLOSURE, /* k:           push lambda k closed over current frame */
+  OP_CALL,    /* n:           call function below n arguments         */
+  OP_TAILCALL,/* n:           as OP_CALL, replacing the current frame */
+  OP_CALL0,   /*              call builtin on top of stack without    */
+              /*              arguments, leaving any other value      */
+  OP_GUARD,   /* k form addr cache: jump to addr unless k is form     */
+  OP_TEST,    /* addr end form arg: pop condition, jump to addr if false */
+  OP_MATCH,   /* addr end:    pop key, jump to addr unless equal to the */
+              /*              value below, which is popped if it is     */
+  OP_POP,     /* addr:        pop value, or jump to addr if an error  */
+  OP_JUMP,    /* addr:        jump to addr                            */
+  OP_RETURN   /*              return top of stack                     */
+} lop_t;
+
+/* Builtins the compiler may inline when their symbol is unchanged */
+typedef enum {
+  LFORM_IF,
+  LFORM_EVAL,
+  LFORM_LAMBDA,
+  LFORM_AND,
+  LFORM_OR,
+  LFORM_WHILE,
+  LFORM_LOOP,
+  LFORM_SELECT,
+  LFORM_CASE,
+  LFORM_LET,
+  LFORM_DO
+} lform_t;
+
+struct lcode {
+  int refs;
+
+  /* Instructions and their operands */
+  int count;
+  int* ops;
+
+  /* Constants referenced by OP_CONST and OP_LOAD */
+  int nconsts;
+  lval** consts;
+
+  /* Number of variables if this is the body of a loop, otherwise -1 */
+  int loop;
+
+  /* While compiling, the formals of the lambda and the code of the one */
+  /* it is written in, which symbols are resolved against              */
+  lval* formals;
+  lcode* outer;
+};
+
+/* --- Maps --- */
+
+/* Entries of a map in the order they were added, except that removing */
+/* one moves the last into its place, indexed by an open addressing    */
+/* table of entry index + 1, or 0 for empty slots                      */
+/*                                                                     */
+/* Changing a shared map gives its entries to the new version, leaving  */
+/* the old one with newer set and, as its entries, how to undo the     */
+/* changes: the old value of each key in order, or NULL where a key    */
+/* was not in the map, and in table the index of its entry. Reading it */
+/* again rebuilds its own entries, in the same order.                  */
+struct lmap {
+  lval* newer;
   int count;
-  char** syms;
+  int cap;
+  lval** keys;
   lval** vals;
+  unsigned long* hashes;
+
+  int size;
+  int* table;
+};
+
+/* --- Reader --- */
+
+/* Position in source text being read, which ends in '\0', with the */
+/* line it is on for error messages. A reader over a file holds a   */
+/* window of it in buf, refilled one top-level expression at a time */
+typedef struct {
+  char* name;
+  char* p;
+  long row;
+  char* line;
+  long col;
+  FILE* file;
+  char* buf;
+  size_t len;
+  size_t cap;
+} lreader;
+
+/* --- Memoization --- */
+
+/* Calls cached by a memoized function, at most this many by default */
+#define LMEMO_CAPACITY 4096
+
+/* Result of a call, found by the hash of its arguments, and linked */
+/* from most to least recently used                                 */
+typedef struct lmemo_entry lmemo_entry;
+struct lmemo_entry {
+  unsigned long hash;
+  int argc;
+  lval** argv;
+  lval* result;
+  lmemo_entry* chain;
+  lmemo_entry* newer;
+  lmemo_entry* older;
+};
+
+struct lmemo {
+  int capacity;
+  int count;
+
+  /* Chained hash table, grown to keep at least two buckets per entry */
+  int size;
+  lmemo_entry** table;
+
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+
+  long hits;
+  long misses;
+  long evictions;
 };
 
+/* --- Allocation --- */
+
+/* Pools carve objects from slabs of this many and recycle them */
+#define LSLAB_OBJECTS 256
+
+/* Cell arrays of up to 2^(LCELL_CLASSES - 1) pointers come from pools */
+#define LCELL_CLASSES 5
+
+typedef struct lfree {
+  struct lfree* next;
+} lfree;
+
+/* Free list of objects of one size */
+typedef struct {
+  char* name;
+  size_t size;
+  lfree* free;
+
+  /* Slabs allocated so far */
+  int nslabs;
+  void** slabs;
+
+  /* Allocations served from the free list, and those needing a slab */
+  long hits;
+  long misses;
+} lpool;
+
+/* Call frame of a lambda entered by the virtual machine */
+typedef struct {
+  lcode* code;
+  int pc;
+  lenv* env;
+  lval* fun;
+} lframe;
+
 /* --- Function prototypes --- */
 char* ltype_name(int t);
+void* lpool_alloc(lpool* p);
+void lpool_free(lpool* p, void* x);
+void* lcells_alloc(int n);
+void* lcells_resize(void* cells, int n, int m);
+void lcells_free(void* cells, int n);
+lval* lval_alloc(lval_t type);
+void lval_free(lval* v);
+lenv* lenv_alloc(void);
+void lenv_free(lenv* e);
+unsigned long lsym_hash(char* s);
+lsym* lsym_intern(char* s);
 lval* lval_fun(lbuiltin func);
+lval* lval_prim(lprim func);
+lval* lval_list(int n, lval** cells);
 lval* lval_num(long n);
+lval* lval_dbl(double x);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
 lval* lval_str(char* s);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
-lval* lval_lambda(lval* formals, lval* body);
-lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_lambda(lval* formals, lval* body, lcode* outer);
+lval* lval_closure(lenv* e, lval* formals, lval* body);
+lval* lval_bind(lenv* e, lval* f, int argc, lval** argv, lenv** env);
+lval* lval_call(lenv* e, lval* f, int argc, lval** argv);
 
 void lval_del(lval* v);
 lval* lval_add(lval* v, lval* x);
 lval* lval_copy(lval* v);
-lval* lval_read_num(mpc_ast_t* t);
-lval* lval_read(mpc_ast_t* t);
-lval* lval_read_str(mpc_ast_t* t);
+lval* lval_own(lval* v);
+void lread_init(lreader* r, char* name, char* text);
+void lread_open(lreader* r, char* name, FILE* f);
+void lread_close(lreader* r);
+lval* lval_read_num(char* s, int n);
+lval* lread_expr(lreader* r);
+lval* lread_next(lreader* r);
+lval* lread_all(lreader* r);
 
 void lval_expr_print(lval* v, char open, char close);
 void lval_print(lval* v);
 void lval_print_str(lval* v);
+void lval_print_dbl(lval* v);
+void ldbl_print(double x);
 void lval_println(lval* v);
 
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 lval* lval_join(lval* x, lval* y);
-lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_args(lenv* e, lval* v, int* n);
+lval* lval_eval_logic(lenv* e, lval* v, lform_t form);
+int lval_has_sym(lval* x);
+int lval_quotes(lval* v);
+lval* lval_eval_list(lenv* e, lval* v);
+lval* lval_eval_expr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
 
+lcode* lcode_compile(lval* formals, lval* body, lcode* outer);
+void lcode_del(lcode* c);
+lval* lvm_run(lval* f, lenv* e);
+void lvm_push(lval* x);
+void lvm_drop(int n);
+lval* lvm_check_call(int n);
+lval* lvm_call(lenv* e, int n);
+
+#ifdef LISPY_GC
+extern int lgc_nroots;
+extern int lgc_nenvroots;
+void lgc_track_val(lval* v);
+void lgc_track_env(lenv* e);
+void lgc_protect(lval* v);
+void lgc_protect_env(lenv* e);
+void lgc_collect(void);
+void lgc_safepoint(void);
+#define LGC_PROTECT(v) lgc_protect(v)
+#define LGC_UNPROTECT(n) (lgc_nroots -= (n))
+#define LGC_PROTECT_ENV(e) lgc_protect_env(e)
+#define LGC_UNPROTECT_ENV(n) (lgc_nenvroots -= (n))
+#else
+#define LGC_PROTECT(v)
+#define LGC_UNPROTECT(n)
+#define LGC_PROTECT_ENV(e)
+#define LGC_UNPROTECT_ENV(n)
+#endif
+
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
+lenv* lenv_ref(lenv* e);
+int lenv_closes(lenv* e, lval* v, int deep, int cut);
+int lenv_unlink(lenv* e, int deep);
+void lenv_leave(lenv* e);
+lval* lenv_search_frames(lenv* e, lsym* k);
+lval* lenv_search(lenv* e, lsym* k, int* cache);
+int lenv_find(lenv* e, lsym* k);
+lval* lenv_lookup(lenv* e, lval* k);
 lval* lenv_get(lenv* e, lval* k);
 lenv* lenv_copy(lenv* e);
+int lenv_eq(lenv* x, lenv* y);
 void lenv_put(lenv* e, lval* k, lval*v);
 void lenv_def(lenv* e, lval* k, lval* v);
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+void lenv_add_prim(lenv* e, char* name, lprim func);
 void lenv_add_builtins(lenv* e);
 int lval_eq(lval* x, lval* y);
 
-lval* builtin(lenv* e, lval* a, char* func);
-lval* builtin_op(lenv* e, lval* a, char* op);
-
-lval* builtin_eval(lenv* e, lval* a);
-
-lval* builtin_head(lenv* e, lval* a);
-lval* builtin_tail(lenv* e, lval* a);
-lval* builtin_list(lenv* e, lval* a);
-lval* builtin_join(lenv* e, lval* a);
-
-lval* builtin_add(lenv* e, lval* a);
-lval* builtin_sub(lenv* e, lval* a);
-lval* builtin_mul(lenv* e, lval* a);
-lval* builtin_div(lenv* e, lval* a);
-
-lval* builtin_def(lenv* e, lval* a);
-lval* builtin_lambda(lenv* e, lval* a);
-
-lval* builtin_put(lenv* e, lval* a);
-lval* builtin_var(lenv*e, lval* a, char* func);
-lval* builtin_load(lenv* e, lval* a);
-lval* builtin_print(lenv* e, lval* a);
-lval* builtin_error(lenv* e, lval* a);
-
-lval* builtin_gt(lenv* e, lval* a);
-lval* builtin_lt(lenv* e, lval* a);
-lval* builtin_ge(lenv* e, lval* a);
-lval* builtin_le(lenv* e, lval* a);
-lval* builtin_ord(lenv* e, lval* a, char* op);
-lval* builtin_cmp(lenv* e, lval* a, char* op);
-lval* builtin_eq(lenv* e, lval* a);
-lval* builtin_ne(lenv* e, lval* a);
-lval* builtin_if(lenv* e, lval* a);
-
-/* --- parsers --- */
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
+lval* builtin(lenv* e, int argc, lval** argv, char* func);
+lval* builtin_op(lenv* e, int argc, lval** argv, lopr_t op);
+
+lval* builtin_eval(lenv* e, int argc, lval** argv);
+lval* builtin_eval_expr(lenv* e, int argc, lval** argv);
+
+lval* builtin_head(lenv* e, int argc, lval** argv);
+lval* builtin_tail(lenv* e, int argc, lval** argv);
+lval* builtin_list(lenv* e, int argc, lval** argv);
+lval* builtin_join(lenv* e, int argc, lval** argv);
+lval* builtin_len(lenv* e, int argc, lval** argv);
+lval* builtin_nth(lenv* e, int argc, lval** argv);
+lval* builtin_last(lenv* e, int argc, lval** argv);
+lval* builtin_take(lenv* e, int argc, lval** argv);
+lval* builtin_drop(lenv* e, int argc, lval** argv);
+lval* builtin_split(lenv* e, int argc, lval** argv);
+lval* builtin_elem(lenv* e, int argc, lval** argv);
+lval* builtin_map(lenv* e, int argc, lval** argv);
+lval* builtin_filter(lenv* e, int argc, lval** argv);
+lval* builtin_foldl(lenv* e, int argc, lval** argv);
+lval* builtin_sum(lenv* e, int argc, lval** argv);
+lval* builtin_product(lenv* e, int argc, lval** argv);
+lval* builtin_apply(lenv* e, int argc, lval** argv);
+lval* builtin_memo(lenv* e, int argc, lval** argv);
+lval* builtin_memo_stats(lenv* e, int argc, lval** argv);
+lval* builtin_memoized(lenv* e, int argc, lval** argv);
+
+unsigned long ldbl_hash(double x);
+unsigned long lval_hash(lval* v);
+lmap* lmap_new(void);
+void lmap_free(lmap* m);
+void lmap_release(lmap* m);
+lmap* lmap_copy(lmap* m);
+int lmap_find(lmap* m, lval* k, unsigned long h);
+void lmap_put(lmap* m, lval* k, lval* v);
+void lmap_remove(lmap* m, lval* k);
+void lmap_set(lmap* m, lmap* undo, lval* k, lval* v);
+lmap* lmap_of(lval* v);
+lval* lval_map_edit(lval* v, lmap** undo);
+lval* lval_map(void);
+
+lval* builtin_map_new(lenv* e, int argc, lval** argv);
+lval* builtin_map_get(lenv* e, int argc, lval** argv);
+lval* builtin_map_has(lenv* e, int argc, lval** argv);
+lval* builtin_map_put(lenv* e, int argc, lval** argv);
+lval* builtin_map_del(lenv* e, int argc, lval** argv);
+lval* builtin_map_len(lenv* e, int argc, lval** argv);
+lval* builtin_map_keys(lenv* e, int argc, lval** argv);
+lval* builtin_map_vals(lenv* e, int argc, lval** argv);
+lval* builtin_map_fold(lenv* e, int argc, lval** argv);
+
+lval* lval_vec(int n);
+lval* lval_fvec(int n);
+
+void lmag_add(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb);
+void lmag_sub(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb);
+void lmag_mul(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb);
+void lmag_kmul(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb);
+void lmag_div(uint32_t* q, uint32_t* a, int na, uint32_t* b, int nb);
+lval* lbig_make(int neg, uint32_t* d, int n);
+lval* lbig_op(lval* x, lval* y, lopr_t op);
+int lbig_cmp(lval* x, lval* y);
+double lbig_dbl(lval* v);
+lval* lbig_of_dbl(double x);
+lval* lbig_read(char* s);
+void lbig_print(lval* v);
+void lvec_sum(long* restrict a, int n, long* hi, unsigned long* lo);
+long lvec_dot(long* restrict a, long* restrict b, int n, int* over);
+int lvec_op(long* restrict r, long* restrict b, int n, lopr_t op);
+int lvec_op_num(long* restrict r, long b, int n, lopr_t op);
+double lvec_fsum(double* restrict a, int n);
+double lvec_fdot(double* restrict a, double* restrict b, int n);
+void lvec_fop(double* restrict r, double* restrict b, int n, lopr_t op);
+void lvec_fop_num(double* restrict r, double b, int n, lopr_t op);
+void lvec_dbls(double* r, lval* v, int n);
+void lvec_promote(lval* v, int n);
+lval* lvec_nth(lval* v, int i);
+
+lval* builtin_vec(lenv* e, int argc, lval** argv);
+lval* builtin_vec_list(lenv* e, int argc, lval** argv);
+lval* builtin_vec_range(lenv* e, int argc, lval** argv);
+lval* builtin_vec_len(lenv* e, int argc, lval** argv);
+lval* builtin_vec_nth(lenv* e, int argc, lval** argv);
+lval* builtin_vec_sum(lenv* e, int argc, lval** argv);
+lval* builtin_vec_min(lenv* e, int argc, lval** argv);
+lval* builtin_vec_max(lenv* e, int argc, lval** argv);
+lval* builtin_vec_dot(lenv* e, int argc, lval** argv);
+lval* builtin_vec_op(lenv* e, int argc, lval** argv, char* func, lopr_t op);
+lval* builtin_vec_add(lenv* e, int argc, lval** argv);
+lval* builtin_vec_sub(lenv* e, int argc, lval** argv);
+lval* builtin_vec_mul(lenv* e, int argc, lval** argv);
+lval* builtin_vec_call(lenv* e, char* func, lval* f, lval* v, int i);
+lval* builtin_vec_map(lenv* e, int argc, lval** argv);
+lval* builtin_vec_filter(lenv* e, int argc, lval** argv);
+lmemo* lmemo_new(int capacity);
+void lmemo_del(lmemo* m);
+lval* lmemo_call(lenv* e, lval* f, int argc, lval** argv);
+
+lval* builtin_add(lenv* e, int argc, lval** argv);
+lval* builtin_sub(lenv* e, int argc, lval** argv);
+lval* builtin_mul(lenv* e, int argc, lval** argv);
+lval* builtin_div(lenv* e, int argc, lval** argv);
+
+lval* builtin_def(lenv* e, int argc, lval** argv);
+lval* builtin_lambda(lenv* e, int argc, lval** argv);
+lval* builtin_fun(lenv* e, int argc, lval** argv);
+
+lval* builtin_put(lenv* e, int argc, lval** argv);
+lval* builtin_var(lenv* e, int argc, lval** argv, int local);
+lval* builtin_load(lenv* e, int argc, lval** argv);
+lval* builtin_print(lenv* e, int argc, lval** argv);
+lval* builtin_show(lenv* e, int argc, lval** argv);
+lval* builtin_error(lenv* e, int argc, lval** argv);
+lval* builtin_catch(lenv* e, int argc, lval** argv);
+
+lval* builtin_gt(lenv* e, int argc, lval** argv);
+lval* builtin_lt(lenv* e, int argc, lval** argv);
+lval* builtin_ge(lenv* e, int argc, lval** argv);
+lval* builtin_le(lenv* e, int argc, lval** argv);
+lval* builtin_ord(lenv* e, int argc, lval** argv, lopr_t op);
+lval* builtin_op_dbl(int argc, lval** argv, lopr_t op);
+lval* builtin_int(lenv* e, int argc, lval** argv);
+lval* builtin_float(lenv* e, int argc, lval** argv);
+lval* builtin_cmp(lenv* e, int argc, lval** argv, lopr_t op);
+lval* builtin_eq(lenv* e, int argc, lval** argv);
+lval* builtin_ne(lenv* e, int argc, lval** argv);
+lval* builtin_if(lenv* e, int argc, lval** argv);
+lval* builtin_if_expr(lenv* e, int argc, lval** argv);
+
+lval* builtin_let(lenv* e, int argc, lval** argv);
+lval* builtin_do(lenv* e, int argc, lval** argv);
+lval* builtin_select(lenv* e, int argc, lval** argv);
+lval* builtin_select_expr(lenv* e, int argc, lval** argv);
+lval* builtin_case(lenv* e, int argc, lval** argv);
+lval* builtin_case_expr(lenv* e, int argc, lval** argv);
+lval* builtin_and(lenv* e, int argc, lval** argv);
+lval* builtin_or(lenv* e, int argc, lval** argv);
+lval* builtin_logic(lenv* e, int argc, lval** argv, lform_t form);
+extern char* lform_name[];
+lval* builtin_while(lenv* e, int argc, lval** argv);
+lval* builtin_dotimes(lenv* e, int argc, lval** argv);
+lval* builtin_loop(lenv* e, int argc, lval** argv);
+lval* builtin_recur(lenv* e, int argc, lval** argv);
+void lloop_set(lenv* n, int i, lval* v);
 
 
 char* ltype_name(int t) {
@@ -196,32 +688,319 @@ char* ltype_name(int t) {
   case LVAL_STR: return "String";
   case LVAL_SEXPR: return "S-Expression";
   case LVAL_QEXPR: return "Q-Expression";
+  case LVAL_MAP: return "Map";
+  case LVAL_VEC: return "Vector";
+  case LVAL_DBL: return "Float";
+  case LVAL_BIG: return "Bignum";
   default: return "Unkonwn";
   }
 }
 
 
+/* --- symbol table --- */
+
+/* FNV-1a hash of a symbol name */
+unsigned long lsym_hash(char* s) {
+  unsigned long h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Chained hash table of every symbol name seen so far */
+lsym** lsym_table = NULL;
+int lsym_size = 0;
+int lsym_count = 0;
+
+/* Symbols the interpreter itself compares against */
+lsym* lsym_amp;
+lsym* lsym_if;
+lsym* lsym_eval;
+lsym* lsym_lambda;
+lsym* lsym_and;
+lsym* lsym_or;
+lsym* lsym_while;
+lsym* lsym_loop;
+lsym* lsym_select;
+lsym* lsym_case;
+lsym* lsym_let;
+lsym* lsym_do;
+lsym* lsym_recur;
+
+/* Return the unique symbol with name s, creating it if needed */
+lsym* lsym_intern(char* s) {
+  unsigned long h = lsym_hash(s);
+
+  if (lsym_size) {
+    for (lsym* k = lsym_table[h & (lsym_size - 1)]; k; k = k->next) {
+      if (k->hash == h && strcmp(k->name, s) == 0) { return k; }
+    }
+  }
+
+  /* Grow table when it would become more than fully loaded */
+  if (lsym_count >= lsym_size) {
+    int size = lsym_size ? lsym_size * 2 : 256;
+    lsym** table = calloc(size, sizeof(lsym*));
+    for (int i = 0; i < lsym_size; i++) {
+      lsym* k = lsym_table[i];
+      while (k) {
+        lsym* next = k->next;
+        k->next = table[k->hash & (size - 1)];
+        table[k->hash & (size - 1)] = k;
+        k = next;
+      }
+    }
+    free(lsym_table);
+    lsym_table = table;
+    lsym_size = size;
+  }
+
+  lsym* k = malloc(sizeof(lsym));
+  k->name = malloc(strlen(s) + 1);
+  strcpy(k->name, s);
+  k->hash = h;
+  k->frames = 0;
+  k->next = lsym_table[h & (lsym_size - 1)];
+  lsym_table[h & (lsym_size - 1)] = k;
+  lsym_count++;
+  return k;
+}
+
+void lsym_init(void) {
+  lsym_amp  = lsym_intern("&");
+  lsym_if   = lsym_intern("if");
+  lsym_eval = lsym_intern("eval");
+  lsym_lambda = lsym_intern("\\");
+  lsym_and  = lsym_intern("and");
+  lsym_or   = lsym_intern("or");
+  lsym_while = lsym_intern("while");
+  lsym_loop = lsym_intern("loop");
+  lsym_select = lsym_intern("select");
+  lsym_case = lsym_intern("case");
+  lsym_let  = lsym_intern("let");
+  lsym_do   = lsym_intern("do");
+  lsym_recur = lsym_intern("recur");
+}
+
+/* Global environment, which def binds in and lexical scopes end at */
+lenv* lenv_global = NULL;
+
+/* Where lval_print writes, stdout but for 'show' */
+FILE* lval_out = NULL;
+
+
+/* --- allocation --- */
+
+/* Pools for the interpreter's objects and small cell arrays */
+lpool lpool_vals = { "lval", sizeof(lval) };
+lpool lpool_envs = { "lenv", sizeof(lenv) };
+lpool lpool_cells[LCELL_CLASSES] = {
+  { "cells[1]",  sizeof(void*) * 1 },
+  { "cells[2]",  sizeof(void*) * 2 },
+  { "cells[4]",  sizeof(void*) * 4 },
+  { "cells[8]",  sizeof(void*) * 8 },
+  { "cells[16]", sizeof(void*) * 16 },
+};
+
+/* Cell arrays too large for any pool */
+long lcells_large = 0;
+
+void* lpool_alloc(lpool* p) {
+#ifdef LISPY_NO_SLAB
+  return malloc(p->size);
+#else
+  /* Reuse a freed object if there is one */
+  if (p->free) {
+    lfree* x = p->free;
+    p->free = x->next;
+    p->hits++;
+    return x;
+  }
+
+  /* Otherwise carve a new slab, returning its first object */
+  p->misses++;
+  char* slab = malloc(p->size * LSLAB_OBJECTS);
+  p->nslabs++;
+  p->slabs = realloc(p->slabs, sizeof(void*) * p->nslabs);
+  p->slabs[p->nslabs - 1] = slab;
+
+  for (int i = LSLAB_OBJECTS - 1; i > 0; i--) {
+    lfree* x = (lfree*)(slab + p->size * i);
+    x->next = p->free;
+    p->free = x;
+  }
+  return slab;
+#endif
+}
+
+void lpool_free(lpool* p, void* x) {
+#ifdef LISPY_NO_SLAB
+  free(x);
+#else
+  lfree* f = x;
+  f->next = p->free;
+  p->free = f;
+#endif
+}
+
+/* Capacity of an array holding n pointers, the next power of two */
+int lcells_cap(int n) {
+  int c = 1;
+  while (c < n) { c *= 2; }
+  return n ? c : 0;
+}
+
+/* Pool index for an array of n pointers, or -1 if it is too large */
+int lcells_class(int n) {
+  int c = 0;
+  while ((1 << c) < n) { c++; }
+  return c < LCELL_CLASSES ? c : -1;
+}
+
+/* Cell arrays are always sized by the count they hold, which callers */
+/* pass back when resizing or freeing them                           */
+void* lcells_alloc(int n) {
+  if (n == 0) { return NULL; }
+  int c = lcells_class(n);
+  if (c < 0) {
+    lcells_large++;
+    return malloc(sizeof(void*) * lcells_cap(n));
+  }
+  return lpool_alloc(&lpool_cells[c]);
+}
+
+void* lcells_resize(void* cells, int n, int m) {
+  if (lcells_cap(n) == lcells_cap(m)) { return cells; }
+  if (lcells_class(n) < 0 && lcells_class(m) < 0) {
+    return realloc(cells, sizeof(void*) * lcells_cap(m));
+  }
+  void* x = lcells_alloc(m);
+  if (n && m) { memcpy(x, cells, sizeof(void*) * (n < m ? n : m)); }
+  lcells_free(cells, n);
+  return x;
+}
+
+void lcells_free(void* cells, int n) {
+  if (!cells) { return; }
+  int c = lcells_class(n);
+  if (c < 0) {
+    free(cells);
+  } else {
+    lpool_free(&lpool_cells[c], cells);
+  }
+}
+
+void lpool_report(lpool* p) {
+  long total = p->hits + p->misses;
+  fprintf(stderr, "alloc: %-10s %12li allocations, %6.2f%% from free list,"
+          " %i slabs\n", p->name, total,
+          total ? 100.0 * p->hits / total : 0.0, p->nslabs);
+}
+
+/* Report statistics if asked to, and release every slab */
+void lalloc_shutdown(void) {
+  lpool* pools[2 + LCELL_CLASSES] = { &lpool_vals, &lpool_envs };
+  for (int i = 0; i < LCELL_CLASSES; i++) { pools[2 + i] = &lpool_cells[i]; }
+
+  int report = getenv("LISPY_ALLOC_STATS") != NULL;
+  for (int i = 0; i < 2 + LCELL_CLASSES; i++) {
+    if (report) { lpool_report(pools[i]); }
+    for (int j = 0; j < pools[i]->nslabs; j++) { free(pools[i]->slabs[j]); }
+    free(pools[i]->slabs);
+  }
+  if (report) {
+    fprintf(stderr, "alloc: %-10s %12li allocations from malloc\n",
+            "cells[>16]", lcells_large);
+  }
+}
+
+/* Allocate an lval of the given type holding a single reference */
+lval* lval_alloc(lval_t type) {
+  lval* v = lpool_alloc(&lpool_vals);
+  v->type = type;
+  v->refs = 1;
+#ifdef LISPY_GC
+  lgc_track_val(v);
+#endif
+  return v;
+}
+
+/* Free the memory of v itself, but not of the values it refers to */
+void lval_free(lval* v) {
+  switch (v->type) {
+  case LVAL_FUN:
+    if (!LBUILTIN_P(v)) { lcode_del(v->code); }
+    if (LMEMO_P(v)) { lmemo_del(v->memo); }
+    break;
+  case LVAL_ERR: free(v->err); break;
+  case LVAL_STR: free(v->str); break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR: lcells_free(v->cell, v->count); break;
+  case LVAL_MAP: lmap_free(v->map); break;
+  case LVAL_VEC: free(v->nums); break;
+  case LVAL_BIG: free(v->limbs); break;
+  default: break;
+  }
+  lpool_free(&lpool_vals, v);
+}
+
+lenv* lenv_alloc(void) {
+  lenv* e = lpool_alloc(&lpool_envs);
+#ifdef LISPY_GC
+  lgc_track_env(e);
+#endif
+  return e;
+}
+
+/* Free the memory of e itself, but not of the values bound in it */
+void lenv_free(lenv* e) {
+  if (e != lenv_global) {
+    for (int i = 0; i < e->count; i++) { e->syms[i]->frames--; }
+  }
+  lcells_free(e->syms, e->cap);
+  lcells_free(e->vals, e->cap);
+  free(e->table);
+  lpool_free(&lpool_envs, e);
+}
+
+
 /* --- lval constructors --- */
 
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
+  v->prim = NULL;
   v->builtin = func;
   return v;
 }
 
+lval* lval_prim(lprim func) {
+  lval* v = lval_alloc(LVAL_FUN);
+  v->prim = func;
+  v->builtin = NULL;
+  return v;
+}
+
 /* Construct a pointer to a new Number lval */
 lval* lval_num(long n) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  if (n >= LFIX_MIN && n <= LFIX_MAX) {
+    return (lval*)(((uintptr_t)(intptr_t)n << 1) | 1);
+  }
+  lval* v = lval_alloc(LVAL_NUM);
   v->num = n;
   return v;
 }
 
+lval* lval_dbl(double x) {
+  lval* v = lval_alloc(LVAL_DBL);
+  v->dbl = x;
+  return v;
+}
+
 /* Construct a pointer to a new Error lval */
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_alloc(LVAL_ERR);
 
   /* Create a va_list and initialize it */
   va_list va;
@@ -244,16 +1023,13 @@ lval* lval_err(char* fmt, ...) {
 
 /* Construct  apointer to a new Symbol lval */
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  lval* v = lval_alloc(LVAL_SYM);
+  v->sym = lsym_intern(s);
   return v;
 }
 
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
+  lval* v = lval_alloc(LVAL_STR);
   v->str = malloc(strlen(s) + 1);
   strcpy(v->str, s);
   return v;
@@ -261,27 +1037,60 @@ lval* lval_str(char* s) {
 
 /* Construct a pointer to a new empty Sexpr lval */
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_alloc(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
+/* A new Q-Expression sharing the n values at cells */
+lval* lval_list(int n, lval** cells) {
+  lval* v = lval_qexpr();
+  v->count = n;
+  v->cell = lcells_alloc(n);
+  for (int i = 0; i < n; i++) { v->cell[i] = lval_copy(cells[i]); }
+  return v;
+}
+
 /* Construct a pointer to a new empty Qexpr lval */
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_alloc(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+lval* lval_map(void) {
+  lval* v = lval_alloc(LVAL_MAP);
+  v->map = lmap_new();
+  return v;
+}
+
+/* A new Vector of n Numbers, left for the caller to fill in */
+lval* lval_vec(int n) {
+  lval* v = lval_alloc(LVAL_VEC);
+  v->count = n;
+  v->floats = 0;
+  v->nums = n ? malloc(sizeof(long) * n) : NULL;
+  return v;
+}
+
+/* A new Vector of n Floats, left for the caller to fill in */
+lval* lval_fvec(int n) {
+  lval* v = lval_alloc(LVAL_VEC);
+  v->count = n;
+  v->floats = 1;
+  v->dbls = n ? malloc(sizeof(double) * n) : NULL;
+  return v;
+}
+
+/* Construct a lambda, compiling its body. outer is the code of the */
+/* lambda it is written in when it closes over that one's frames    */
+lval* lval_lambda(lval* formals, lval* body, lcode* outer) {
+  lval* v = lval_alloc(LVAL_FUN);
 
   /* Set builtin to NULL */
+  v->prim = NULL;
   v->builtin = NULL;
 
   /* Build new environment */
@@ -290,264 +1099,337 @@ lval* lval_lambda(lval* formals, lval* body) {
   /* Set formals and body */
   v->formals = formals;
   v->body = body;
+
+  /* Compile body once, copies of this lambda share the code */
+  v->code = lcode_compile(formals, body, outer);
+  return v;
+}
+
+/* Construct a lambda closing over scope e, as made by a builtin */
+lval* lval_closure(lenv* e, lval* formals, lval* body) {
+  lval* v = lval_lambda(formals, body, NULL);
+  v->env->par = (e == lenv_global) ? NULL : lenv_ref(e);
   return v;
 }
 
 void lval_del(lval* v) {
+#ifdef LISPY_GC
+  /* Unreachable values are freed by the collector */
+  (void)v;
+#else
 
-  switch (v->type) {
-    /* Do nothing special for number type */
-  case LVAL_NUM: break;
+  /* Fixnums are not allocated, others once the last reference is gone */
+  if (LFIX_P(v)) { return; }
+  if (--v->refs) {
+    /* A closure now held only by the frame it was made in may be all */
+    /* that keeps that frame alive, so let lenv_del check it          */
+    if (v->refs == 1 && v->type == LVAL_FUN && !LBUILTIN_P(v)
+        && v->env->refs == 1 && v->env->par) {
+      lenv_del(lenv_ref(v->env->par));
+    }
+    return;
+  }
 
+  switch (v->type) {
   case LVAL_FUN:
-    if (!v->builtin) {
+    if (!LBUILTIN_P(v)) {
       lenv_del(v->env);
       lval_del(v->formals);
       lval_del(v->body);
     }
+    if (LMEMO_P(v)) { lval_del(v->body); }
     break;
 
-    /* For Err or Sym, free the string data */
-  case LVAL_ERR: free(v->err); break;
-  case LVAL_SYM: free(v->sym); break;
-  case LVAL_STR: free(v->str); break;
-
     /* If Sexpr or Qexpr, then delete all elements inside */
   case LVAL_QEXPR:
   case LVAL_SEXPR:
     for (int i = 0; i < v->count; i++) {
       lval_del(v->cell[i]);
     }
-    /* Alsoo free the memory allocated to contain the pointers */
-    free(v->cell);
     break;
+
+  case LVAL_MAP: {
+    /* Old versions of a map hold the next, so release a chain of them */
+    /* in a loop as it can be long                                     */
+    lval* n = v->map->newer;
+    lmap_release(v->map);
+    while (n && --n->refs == 0) {
+      lval* next = n->map->newer;
+      lmap_release(n->map);
+      lval_free(n);
+      n = next;
+    }
+    break;
+  }
+
+  default: break;
   }
 
-  /* Free the memory allocated for the lval struct itself */
-  free(v);
+  /* Free the memory allocated for the lval itself */
+  lval_free(v);
+#endif
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+/* Bind arguments to the formals of lambda f in a new environment.     */
+/* Returns NULL and sets env if f is fully applied, otherwise an error */
+/* or the partially applied function. f and the arguments are left     */
+/* unchanged.                                                          */
+lval* lval_bind(lenv* e, lval* f, int argc, lval** argv, lenv** env) {
 
-  /* If builtin, then simply call that */
-  if (f->builtin) { return f->builtin(e, a); }
+  /* Start from the arguments f has already been partially applied to */
+  lenv* n = lenv_copy(f->env);
+  lval* formals = f->formals;
 
   /* Record argument counts */
-  int given = a->count;
-  int total = f->formals->count;
+  int given = argc;
+  int total = formals->count;
+
+  /* Index of the next formal to bind */
+  int i = 0;
 
-  /* while arguments still remain to be processed */
-  while (a->count) {
+  for (int j = 0; j < argc; j++) {
 
     /* If we've ran out of formal arguments to bind */
-    if (f->formals->count == 0) {
-      lval_del(a);
+    if (i == formals->count) {
+      lenv_del(n);
       return lval_err("Function passed too many argument. "
                       "Got %i, Expected %i.",
                       given,
                       total);
     }
 
-    /* Pop the first symbol from the formals */
-    lval* sym = lval_pop(f->formals, 0);
+    lval* sym = formals->cell[i++];
 
     /* Special case to deal with '&' */
-    if (strcmp(sym->sym, "&") == 0 ) {
+    if (sym->sym == lsym_amp) {
 
       /* Ensure '&' is followed by another symbol */
-      if (f->formals->count != 1) {
-        lval_del(a);
+      if (i != formals->count - 1) {
+        lenv_del(n);
         return lval_err("Function format invalid. "
                         "Symbol '&' not followed by single symbol.");
       }
 
       /* Next formal should be bound to remaining arguments */
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
+      lval* rest = lval_list(argc - j, &argv[j]);
+      lenv_put(n, formals->cell[i++], rest);
+      lval_del(rest);
       break;
     }
 
-    /* If '&' remains in formal list, bind to empty list */
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->sym, "&") == 0) {
-
-      /* Check to ensure that '&' is not passed invalid */
-      if (f->formals->count != 2) {
-        return lval_err("Function format invalid. "
-                        "Symbol '&' not followed by single symbol.");
-      }
-
-      /* Pop and delete '&' symbol */
-      lval_del(lval_pop(f->formals, 0));
+    /* Bind the argument into the new environment */
+    lenv_put(n, sym, argv[j]);
+  }
 
-      /* Pop next symbol and create empty list */
-      lval* sym = lval_pop(f->formals, 0);
-      lval* val = lval_qexpr();
+  /* If '&' remains in formal list, bind to empty list */
+  if (i < formals->count && formals->cell[i]->sym == lsym_amp) {
 
-      /* Bind to environment and delete */
-      lenv_put(f->env, sym, val);
-      lval_del(sym);
-      lval_del(val);
+    /* Check to ensure that '&' is not passed invalid */
+    if (formals->count - i != 2) {
+      lenv_del(n);
+      return lval_err("Function format invalid. "
+                      "Symbol '&' not followed by single symbol.");
     }
 
-    /* Pop the next argument from the list */
-    lval* val = lval_pop(a, 0);
+    lval* val = lval_qexpr();
+    lenv_put(n, formals->cell[i + 1], val);
+    lval_del(val);
+    i += 2;
+  }
 
-    /* Bind a copy into the functions's environment */
-    lenv_put(f->env, sym, val);
+  /* If all formals have been bound, evaluate */
+  if (i == formals->count) {
 
-    /* Delete symbol and value */
-    lval_del(sym);
-    lval_del(val);
+    /* Remember the caller for symbols not bound lexically */
+    n->dyn = e;
+    *env = n;
+    return NULL;
   }
 
-  /* argument list is now bound, so it can be cleaned up */
-  lval_del(a);
+  /* Otherwise, return partially applied function */
+  lval* p = lval_alloc(LVAL_FUN);
+  p->prim = NULL;
+  p->builtin = NULL;
+  p->env = n;
+  p->formals = lval_qexpr();
+  for (; i < formals->count; i++) {
+    p->formals = lval_add(p->formals, lval_copy(formals->cell[i]));
+  }
+  p->body = lval_copy(f->body);
+  p->code = f->code;
+  p->code->refs++;
+  return p;
+}
 
-  /* If all formals have been bound, evaluate */
-  if (f->formals->count == 0) {
+/* Call f with the argc arguments at argv, which are left unchanged */
+lval* lval_call(lenv* e, lval* f, int argc, lval** argv) {
 
-    /* Set environment parent to evaluation environment */
-    f->env->par = e;
+  if (LMEMO_P(f)) { return lmemo_call(e, f, argc, argv); }
 
-    /* Evaluate and return */
-    return builtin_eval(f->env,
-                        lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    /* Otherwise, return partially evaluated function */
-    return lval_copy(f);
+  /* If builtin, then simply call that */
+  if (f->prim) { return f->prim(e, argc, argv); }
+
+  /* Older builtins are given an argument list of their own */
+  if (f->builtin) {
+    lval* a = lval_sexpr();
+    a->count = argc;
+    a->cell = lcells_alloc(argc);
+    for (int i = 0; i < argc; i++) { a->cell[i] = lval_copy(argv[i]); }
+    return f->builtin(e, a);
   }
 
+  /* Bind arguments, then run compiled body if all were given */
+  lenv* env;
+  lval* x = lval_bind(e, f, argc, argv, &env);
+  if (x) { return x; }
+  return lvm_run(lval_copy(f), env);
 }
 
 lval* lval_add(lval* v, lval* x) {
+  v = lval_own(v);
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = lcells_resize(v->cell, v->count - 1, v->count);
   v->cell[v->count - 1] = x;
   return v;
 }
 
 lval* lval_copy(lval* v) {
+  if (LFIX_P(v)) { return v; }
 
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  /* Copies simply share the value */
+#ifdef LISPY_GC
+  v->refs = 2;
+#else
+  v->refs++;
+#endif
+  return v;
+}
+
+/* Return v if no one else refers to it, otherwise drop our reference */
+/* and return a shallow copy which can be changed in place            */
+lval* lval_own(lval* v) {
+  if (LFIX_P(v) || v->refs == 1) { return v; }
+
+  lval* x = lval_alloc(v->type);
 
   switch (v->type) {
 
   case LVAL_FUN:
-    if (v->builtin) {
-      x->builtin = v->builtin;
-    } else {
-      x->builtin = NULL;
+    x->prim = v->prim;
+    x->builtin = v->builtin;
+    if (!LBUILTIN_P(v)) {
       x->env = lenv_copy(v->env);
       x->formals = lval_copy(v->formals);
       x->body = lval_copy(v->body);
+      x->code = v->code;
+      x->code->refs++;
+    }
+
+    /* A copy starts with a cache of its own */
+    if (LMEMO_P(v)) {
+      x->body = lval_copy(v->body);
+      x->memo = lmemo_new(v->memo->capacity);
     }
     break;
 
   case LVAL_NUM: x->num = v->num; break;
+  case LVAL_DBL: x->dbl = v->dbl; break;
 
     /* Copy Strings using malloc and strcpy */
   case LVAL_ERR:
     x->err = malloc(strlen(v->err) + 1);
     strcpy(x->err, v->err); break;
 
-  case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym); break;
+    /* Symbols are interned so they are simply shared */
+  case LVAL_SYM: x->sym = v->sym; break;
 
   case LVAL_STR:
     x->str = malloc(strlen(v->str) + 1);
     strcpy(x->str, v->str);
     break;
 
-    /* Copy Lists by copying each sub-expression */
+    /* Copy Lists by sharing each sub-expression */
   case LVAL_SEXPR:
   case LVAL_QEXPR:
     x->count = v->count;
-    x->cell = malloc(sizeof(lval*) * x->count);
+    x->cell = lcells_alloc(x->count);
     for (int i = 0; i < x->count; i++) {
       x->cell[i] = lval_copy(v->cell[i]);
     }
     break;
-  }
-
-  return x;
-}
 
-lval* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
-}
-
-lval* lval_read(mpc_ast_t* t) {
-
-  /* If Symbol or Number, return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  case LVAL_MAP: x->map = lmap_copy(lmap_of(v)); break;
 
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-
-  /* If too (>) or sexpr, then create empty list */
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  case LVAL_VEC: {
+    size_t size = v->floats ? sizeof(double) : sizeof(long);
+    x->count = v->count;
+    x->floats = v->floats;
+    x->nums = v->count ? malloc(size * v->count) : NULL;
+    if (v->count) { memcpy(x->nums, v->nums, size * v->count); }
+    break;
+  }
 
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; i++) {
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+  case LVAL_BIG:
+    x->count = v->count;
+    x->limbs = malloc(sizeof(uint32_t) * abs(v->count));
+    memcpy(x->limbs, v->limbs, sizeof(uint32_t) * abs(v->count));
+    break;
   }
 
+#ifndef LISPY_GC
+  v->refs--;
+#endif
   return x;
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-  /* Cut off the final quote character */
-  t->contents[strlen(t->contents) - 1] = '\0';
-
-  /* Copy the string missing out the first quote character */
-  char* unescaped = malloc(strlen(t->contents + 1) + 1);
-  strcpy(unescaped, t->contents + 1);
-
-  /* Pass though the unescape function */
-  unescaped = mpcf_unescape(unescaped);
-
-  /* Construct a new lval using the string */
-  lval* str = lval_str(unescaped);
-
-  /* Free the string and return */
-  free(unescaped);
-  return str;
-}
-
 /* Print an lval */
 void lval_print(lval* v) {
-  switch (v->type) {
-  case LVAL_NUM:   printf("%li", v->num); break;
-  case LVAL_ERR:   printf("Error: %s", v->err); break;
-  case LVAL_SYM:   printf("%s", v->sym); break;
+  switch (LTYPE(v)) {
+  case LVAL_NUM:   fprintf(lval_out, "%li", LNUM(v)); break;
+  case LVAL_DBL:   lval_print_dbl(v); break;
+  case LVAL_BIG:   lbig_print(v); break;
+  case LVAL_ERR:   fprintf(lval_out, "Error: %s", v->err); break;
+  case LVAL_SYM:   fprintf(lval_out, "%s", v->sym->name); break;
   case LVAL_STR:   lval_print_str(v); break;
   case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
   case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+  case LVAL_MAP: {
+    lmap* m = lmap_of(v);
+    fprintf(lval_out, "#{");
+    for (int i = 0; i < m->count; i++) {
+      if (i) { fputc(' ', lval_out); }
+      lval_print(m->keys[i]);
+      fputc(' ', lval_out);
+      lval_print(m->vals[i]);
+    }
+    fputc('}', lval_out);
+    break;
+  }
+  case LVAL_VEC:
+    fprintf(lval_out, "#[");
+    for (int i = 0; i < v->count; i++) {
+      if (i) { fputc(' ', lval_out); }
+      if (v->floats) {
+        ldbl_print(v->dbls[i]);
+      } else {
+        fprintf(lval_out, "%li", v->nums[i]);
+      }
+    }
+    fputc(']', lval_out);
+    break;
   case LVAL_FUN:
-    if (v->builtin) {
-      printf("<builtin>");
+    if (LMEMO_P(v)) {
+      fprintf(lval_out, "(memo ");
+      lval_print(v->body);
+      fputc(')', lval_out);
+    } else if (LBUILTIN_P(v)) {
+      fprintf(lval_out, "<builtin>");
     } else {
-      printf("(\\ ");
+      fprintf(lval_out, "(\\ ");
       lval_print(v->formals);
-      putchar(' ');
+      fputc(' ', lval_out);
       lval_print(v->body);
-      putchar(')');
+      fputc(')', lval_out);
     }
     break;
 
@@ -561,13 +1443,42 @@ void lval_print_str(lval* v) {
   /* Pass it through the escape function */
   escaped = mpcf_escape(escaped);
   /* Print it between " characters */
-  printf("\"%s\"", escaped);
+  fprintf(lval_out, "\"%s\"", escaped);
   /* Free the copied string */
   free(escaped);
 }
 
+/* Print the shortest of 15 to 17 digits which reads back as the */
+/* same double, keeping a point so that it reads back as a Float. */
+/* Infinities and NaN are the exception: the reader has no syntax */
+/* for them, so they print as inf, -inf and nan                   */
+void ldbl_print(double x) {
+  if (isnan(x)) { fputs("nan", lval_out); return; }
+  if (isinf(x)) { fputs(x < 0 ? "-inf" : "inf", lval_out); return; }
+
+  char buf[32];
+  for (int p = 15; p <= 17; p++) {
+    snprintf(buf, sizeof(buf), "%.*g", p, x);
+    if (strtod(buf, NULL) == x) { break; }
+  }
+
+  /* Put the point before any exponent, so 1e+20 prints as 1.0e+20 */
+  int n = strspn(buf, "-0123456789");
+  if (buf[n] != '.') {
+    char exp[32];
+    strcpy(exp, buf + n);
+    strcpy(buf + n, ".0");
+    strcat(buf, exp);
+  }
+  fputs(buf, lval_out);
+}
+
+void lval_print_dbl(lval* v) {
+  ldbl_print(v->dbl);
+}
+
 void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
+  fputc(open, lval_out);
   for (int i = 0; i < v->count; i++) {
 
     /* Print Value contained within */
@@ -575,19 +1486,20 @@ void lval_expr_print(lval* v, char open, char close) {
 
     /* Don't print trailing space if last element */
     if (i != (v->count - 1)) {
-      putchar(' ');
+      fputc(' ', lval_out);
     }
   }
-  putchar(close);
+  fputc(close, lval_out);
 }
 
 
 /* Print an lval followed by a newline */
 void lval_println(lval* v) {
   lval_print(v);
-  putchar('\n');
+  fputc('\n', lval_out);
 }
 
+/* Remove item i from v, which must not be shared */
 lval* lval_pop(lval* v, int i) {
   /* Find the item at index i */
   lval* x = v->cell[i];
@@ -599,100 +1511,158 @@ lval* lval_pop(lval* v, int i) {
   v->count--;
 
   /* Reallocate the memry used */
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = lcells_resize(v->cell, v->count + 1, v->count);
   return x;
 }
 
 lval* lval_take(lval* v, int i) {
-  lval* x = lval_pop(v, i);
+  /* Take a reference to item i and let go of the list */
+  lval* x = lval_copy(v->cell[i]);
   lval_del(v);
   return x;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
+/* Evaluate v, returning a new reference and leaving v unchanged */
+lval* lval_eval_expr(lenv* e, lval* v) {
+  switch (LTYPE(v)) {
   /* Looking for a symbol in the environment */
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
-  }
+  case LVAL_SYM: return lenv_get(e, v);
   /* Evaluate s-expressions */
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+  case LVAL_SEXPR: return lval_eval_list(e, v);
   /* All other lval types remain the same */
-  return v;
+  default: return lval_copy(v);
+  }
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+  lval* x = lval_eval_expr(e, v);
+  lval_del(v);
+  return x;
 }
 
 
 lval* lval_join(lval* x, lval* y) {
 
-  /* For each cell in y add it to x */
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  /* Make room in x for every cell of y */
+  x = lval_own(x);
+  x->cell = lcells_resize(x->cell, x->count, x->count + y->count);
+
+  /* For each cell in y add a reference to it to x */
+  for (int i = 0; i < y->count; i++) {
+    x->cell[x->count++] = lval_copy(y->cell[i]);
   }
 
-  /* Delete the empty y and return x */
+  /* Delete y and return x */
   lval_del(y);
   return x;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+/* Evaluate the cells of list v as an S-Expression, leaving v unchanged. */
+/* Returns the result if there is nothing to call, otherwise NULL with  */
+/* the function and its n arguments pushed on the value stack           */
+lval* lval_eval_args(lenv* e, lval* v, int* n) {
 
-  /* Evaluate children */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+  /* Empty expression */
+  if (v->count == 0) { return lval_sexpr(); }
+
+  /* Single expression, which in parentheses calls a builtin with no */
+  /* arguments, as in (map-new)                                      */
+  if (v->count == 1) {
+    lval* x = lval_eval_expr(e, v->cell[0]);
+    if (LTYPE(v) != LVAL_SEXPR || LTYPE(x) != LVAL_FUN || !LBUILTIN_P(x)) {
+      return x;
+    }
+    lvm_push(x);
+    *n = 0;
+    return NULL;
   }
 
-  /* Error checking */
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-  }
+  /* 'and' and 'or' only evaluate their second argument if needed */
+  if (v->count == 3 && LTYPE(v->cell[0]) == LVAL_SYM
+      && (v->cell[0]->sym == lsym_and || v->cell[0]->sym == lsym_or)) {
+    lval* f = lenv_lookup(e, v->cell[0]);
+    if (f && LTYPE(f) == LVAL_FUN && f->prim == builtin_and) {
+      return lval_eval_logic(e, v, LFORM_AND);
+    }
+    if (f && LTYPE(f) == LVAL_FUN && f->prim == builtin_or) {
+      return lval_eval_logic(e, v, LFORM_OR);
+    }
+  }
 
-  /* Empty expression */
-  if (v->count == 0) { return v; }
+  /* Evaluate children onto the value stack, which also keeps them */
+  /* safe from the collector                                       */
+  LGC_PROTECT(v);
+  for (int i = 0; i < v->count; i++) {
+    lvm_push(lval_eval_expr(e, v->cell[i]));
+  }
+  LGC_UNPROTECT(1);
 
-  /* Single expression */
-  if (v->count == 1) { return lval_take(v, 0); }
+  *n = v->count - 1;
+  return lvm_check_call(*n);
+}
 
-  /* Ensure first element is a Function after evaluation */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err("S-Expression start with incorrect type. "
-                         "Got %s, Expected: %s.",
-                         ltype_name(f->type),
-                         ltype_name(LVAL_FUN));
-    lval_del(f);
-    lval_del(v);
-    return err;
+/* (and x y) or (or x y) evaluated as when compiled inline, giving 1 */
+/* or 0 and evaluating y only when x does not decide the result      */
+lval* lval_eval_logic(lenv* e, lval* v, lform_t form) {
+  LGC_PROTECT(v);
+  lval* r = NULL;
+  for (int i = 1; i < 3 && !r; i++) {
+    lval* x = lval_eval_expr(e, v->cell[i]);
+    if (LTYPE(x) == LVAL_NUM) {
+      int t = LNUM(x) != 0;
+      if (form == LFORM_AND ? !t : t) { r = lval_num(t); }
+    } else if (LTYPE(x) == LVAL_ERR) {
+      r = lval_copy(x);
+    } else {
+      r = lval_err("Function '%s' passed incorrect type for argument %i. "
+                   "Got %s, Expected %s.", lform_name[form], i - 1,
+                   ltype_name(LTYPE(x)), ltype_name(LVAL_NUM));
+    }
+    lval_del(x);
   }
+  LGC_UNPROTECT(1);
+  return r ? r : lval_num(form == LFORM_AND);
+}
+
+/* Evaluate the cells of list v as an S-Expression, leaving v unchanged */
+lval* lval_eval_list(lenv* e, lval* v) {
+  int n;
+  lval* x = lval_eval_args(e, v, &n);
+  if (x) { return x; }
 
   /* Call function to get result */
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  return lvm_call(e, n);
 }
 
 int lval_eq(lval* x, lval* y) {
 
   /* Different types are always unequal */
-  if (x->type != y->type) { return 0; }
+  if (LTYPE(x) != LTYPE(y)) { return 0; }
 
   /* Compare based upon type */
-  switch (x->type) {
+  switch (LTYPE(x)) {
     /* Compare number value */
-  case LVAL_NUM: return (x->num == y->num);
+  case LVAL_NUM: return (LNUM(x) == LNUM(y));
+  case LVAL_DBL: return (x->dbl == y->dbl);
+  case LVAL_BIG:
+    return x->count == y->count
+      && memcmp(x->limbs, y->limbs, sizeof(uint32_t) * abs(x->count)) == 0;
 
     /* Compare string values */
   case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-  case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+  case LVAL_SYM: return (x->sym == y->sym);
   case LVAL_STR: return (strcmp(x->str, y->str) == 0);
 
-    /* If builtin compare, otherwise compare formals and body */
+    /* If builtin compare, otherwise compare formals, body and the */
+    /* environment, which closures must share the parent of       */
   case LVAL_FUN:
-    if (x->builtin || y->builtin) {
-      return x->builtin == y->builtin;
+    if (LMEMO_P(x) || LMEMO_P(y)) {
+      return x == y;
+    } else if (LBUILTIN_P(x) || LBUILTIN_P(y)) {
+      return x->prim == y->prim && x->builtin == y->builtin;
     } else {
       return lval_eq(x->formals, y->formals) &&
-        lval_eq(x->body, y->body);
+        lval_eq(x->body, y->body) && lenv_eq(x->env, y->env);
     }
 
     /* If list, compare every individual element */
@@ -706,518 +1676,4492 @@ int lval_eq(lval* x, lval* y) {
     /* Otherwise, lists must be equal */
     return 1;
     break;
+
+    /* Maps are equal with the same entries in any order */
+  case LVAL_MAP: {
+    lmap* a = lmap_of(x);
+    lmap* b = lmap_of(y);
+    if (a->count != b->count) { return 0; }
+    for (int i = 0; i < a->count; i++) {
+      int j = lmap_find(b, a->keys[i], a->hashes[i]);
+      if (j < 0 || !lval_eq(a->vals[i], b->vals[j])) { return 0; }
+    }
+    return 1;
+  }
+
+  case LVAL_VEC:
+    /* Like a Number and a Float, the two kinds of Vector are unequal */
+    if (x->count != y->count || x->floats != y->floats) { return 0; }
+    if (!x->floats) {
+      return x->count == 0
+        || memcmp(x->nums, y->nums, sizeof(long) * x->count) == 0;
+    }
+    for (int i = 0; i < x->count; i++) {
+      if (x->dbls[i] != y->dbls[i]) { return 0; }
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* --- reader --- */
+
+/* Source text is read straight into values in a single pass, with */
+/* the syntax                                                      */
+/*                                                                 */
+/*   number  : /-?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?/             */
+/*   symbol  : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/                        */
+/*   string  : /"(\\.|[^"])*"/                                     */
+/*   comment : ';' up to the end of the line                       */
+/*   sexpr   : '(' <expr>* ')'                                     */
+/*   qexpr   : '{' <expr>* '}'                                     */
+/*   expr    : <number> | <symbol> | <string> | <comment>          */
+/*           | <sexpr> | <qexpr>                                   */
+/*                                                                 */
+/* where a number is only as long as the pattern matches, so 1abc  */
+/* is the number 1 then the symbol abc, and comments are skipped.  */
+
+#define LREAD_DIGIT_P(c) ((c) >= '0' && (c) <= '9')
+
+/* Bytes read from a file at a time, and the least its buffer holds */
+#define LREAD_CHUNK 65536
+
+void lread_init(lreader* r, char* name, char* text) {
+  r->name = name;
+  r->p = text;
+  r->row = 0;
+  r->line = text;
+  r->col = 0;
+  r->file = NULL;
+  r->buf = NULL;
+  r->len = 0;
+  r->cap = 0;
+}
+
+/* Read from file f, which the caller still closes */
+void lread_open(lreader* r, char* name, FILE* f) {
+  char* buf = malloc(LREAD_CHUNK + 1);
+  buf[0] = '\0';
+  lread_init(r, name, buf);
+  r->file = f;
+  r->buf = buf;
+  r->cap = LREAD_CHUNK;
+}
+
+void lread_close(lreader* r) {
+  free(r->buf);
+}
+
+/* Step over the next character, keeping count of lines */
+void lread_advance(lreader* r) {
+  if (*r->p == '\n') {
+    r->row++;
+    r->line = r->p + 1;
+    r->col = 0;
+  }
+  r->p++;
+}
+
+/* Name of character c for error messages */
+char* lread_char_name(char c, char* buf) {
+  switch (c) {
+  case '\0': return "end of input";
+  case '\n': return "newline";
+  case '\r': return "carriage return";
+  case '\t': return "tab";
+  case ' ': return "space";
+  default:
+    sprintf(buf, "'%c'", c);
+    return buf;
+  }
+}
+
+/* An error saying msg of the text at s, on the reader's line */
+lval* lread_error_at(lreader* r, char* s, char* msg) {
+  return lval_err("%s:%li:%li: error: %s", r->name,
+                  r->row + 1, r->col + (long)(s - r->line) + 1, msg);
+}
+
+/* An error for the reader's position, which expected something else */
+lval* lread_error(lreader* r, char* expected) {
+  char buf[4];
+  char msg[256];
+  snprintf(msg, sizeof(msg), "expected %s at %s", expected,
+           lread_char_name(*r->p, buf));
+  return lread_error_at(r, r->p, msg);
+}
+
+int lread_symbol_p(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+    || LREAD_DIGIT_P(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+/* Check if c may begin an expression */
+int lread_start_p(char c) {
+  return c == '(' || c == '{' || c == '"' || lread_symbol_p(c);
+}
+
+/* Skip whitespace and comments */
+void lread_space(lreader* r) {
+  while (1) {
+    switch (*r->p) {
+    case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+      lread_advance(r);
+      break;
+    case ';':
+      while (*r->p && *r->p != '\n' && *r->p != '\r') { r->p++; }
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+/* Read the token of n characters at s as a Number, Float or Bignum, */
+/* or NULL for a Float too large to hold                             */
+lval* lval_read_num(char* s, int n) {
+  char c = s[n];
+  s[n] = '\0';
+  errno = 0;
+
+  /* Literals with a fraction or exponent are Floats */
+  lval* x;
+  if (strpbrk(s, ".eE")) {
+    /* Underflow is also a range error, but only overflow loses it */
+    double d = strtod(s, NULL);
+    x = (errno == ERANGE && (d == HUGE_VAL || d == -HUGE_VAL))
+      ? NULL : lval_dbl(d);
+  } else {
+    /* Those too large for a long are Bignums */
+    long l = strtol(s, NULL, 10);
+    x = errno != ERANGE ? lval_num(l) : lbig_read(s);
+  }
+
+  s[n] = c;
+  return x;
+}
+
+/* Read a number, a symbol, or a symbol after a number */
+lval* lread_atom(lreader* r) {
+  char* s = r->p;
+
+  /* A number is as much as matches its pattern */
+  char* q = s + (*s == '-');
+  if (LREAD_DIGIT_P(*q)) {
+    while (LREAD_DIGIT_P(*q)) { q++; }
+    if (q[0] == '.' && LREAD_DIGIT_P(q[1])) {
+      q++;
+      while (LREAD_DIGIT_P(*q)) { q++; }
+    }
+    if (*q == 'e' || *q == 'E') {
+      char* t = q + 1;
+      if (*t == '-' || *t == '+') { t++; }
+      if (LREAD_DIGIT_P(*t)) {
+        while (LREAD_DIGIT_P(*t)) { t++; }
+        q = t;
+      }
+    }
+    r->p = q;
+    lval* x = lval_read_num(s, q - s);
+    if (x) { return x; }
+    char msg[256];
+    snprintf(msg, sizeof(msg), "number %.*s is too large for a Float",
+             (int)(q - s), s);
+    return lread_error_at(r, s, msg);
+  }
+
+  while (lread_symbol_p(*r->p)) { r->p++; }
+  char c = *r->p;
+  *r->p = '\0';
+  lval* x = lval_sym(s);
+  *r->p = c;
+  return x;
+}
+
+lval* lread_str(lreader* r) {
+  lread_advance(r);
+  char* s = r->p;
+  while (*r->p != '"') {
+    if (*r->p == '\\' && r->p[1]) { lread_advance(r); }
+    if (*r->p == '\0') { return lread_error(r, "'\"'"); }
+    lread_advance(r);
+  }
+
+  /* Copy the string between the quotes and unescape it */
+  char* unescaped = malloc(r->p - s + 1);
+  memcpy(unescaped, s, r->p - s);
+  unescaped[r->p - s] = '\0';
+  unescaped = mpcf_unescape(unescaped);
+  lread_advance(r);
+
+  lval* str = lval_str(unescaped);
+  free(unescaped);
+  return str;
+}
+
+/* What may come next in a list ending in close */
+char* lread_expected(char close) {
+  return close == ')'
+    ? "number, symbol, string, comment, '(', '{' or ')'"
+    : close == '}'
+    ? "number, symbol, string, comment, '(', '{' or '}'"
+    : "number, symbol, string, comment, '(', '{' or end of input";
+}
+
+/* Read expressions into x up to the character close, which is */
+/* '\0' for the end of the input                               */
+lval* lread_list(lreader* r, lval* x, char close) {
+  while (1) {
+    lread_space(r);
+    if (*r->p == close) {
+      if (close) { lread_advance(r); }
+      return x;
+    }
+
+    if (!lread_start_p(*r->p)) {
+      lval_del(x);
+      return lread_error(r, lread_expected(close));
+    }
+
+    lval* y = lread_expr(r);
+    if (LTYPE(y) == LVAL_ERR) {
+      lval_del(x);
+      return y;
+    }
+    x = lval_add(x, y);
+  }
+}
+
+/* Read the expression at the reader, which lread_start_p accepts */
+lval* lread_expr(lreader* r) {
+  switch (*r->p) {
+  case '(':
+    lread_advance(r);
+    return lread_list(r, lval_sexpr(), ')');
+  case '{':
+    lread_advance(r);
+    return lread_list(r, lval_qexpr(), '}');
+  case '"':
+    return lread_str(r);
+  default:
+    return lread_atom(r);
+  }
+}
+
+/* Read all of the text as an S-Expression of its expressions */
+lval* lread_all(lreader* r) {
+  return lread_list(r, lval_sexpr(), '\0');
+}
+
+/* Check if the text from s to end holds the whole of the next top-level */
+/* expression, or enough of it for the reader to find an error or a '\0' */
+int lread_whole_p(char* s, char* end) {
+  int depth = 0;
+  while (s < end) {
+    switch (*s) {
+    case '\0':
+      return 1;
+    case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+      s++;
+      break;
+    case ';':
+      while (s < end && *s && *s != '\n' && *s != '\r') { s++; }
+      break;
+    case '"':
+      for (s++; s < end && *s != '"'; s++) {
+        if (*s == '\0') { return 1; }
+        if (*s == '\\' && ++s == end) { return 0; }
+      }
+      if (s == end) { return 0; }
+      s++;
+      if (depth == 0) { return 1; }
+      break;
+    case '(': case '{':
+      depth++;
+      s++;
+      break;
+    case ')': case '}':
+      s++;
+      if (depth == 0 || --depth == 0) { return 1; }
+      break;
+    default:
+      /* Anything else the reader stops at, so it is an error */
+      if (!lread_symbol_p(*s) && *s != '.') { return 1; }
+
+      /* An atom is whole once something follows it, the '.' of */
+      /* a Float included                                        */
+      while (s < end && (lread_symbol_p(*s) || *s == '.')) { s++; }
+      if (s == end) { return 0; }
+      if (depth == 0) { return 1; }
+      break;
+    }
+  }
+  return 0;
+}
+
+/* Refill the buffer of a reader over a file until it holds the next */
+/* top-level expression whole, dropping what has been read before it */
+void lread_fill(lreader* r) {
+  while (r->file && !lread_whole_p(r->p, r->buf + r->len)) {
+
+    /* Move the unread text to the front, keeping columns right */
+    if (r->p > r->buf) {
+      r->col += r->p - r->line;
+      r->len -= r->p - r->buf;
+      memmove(r->buf, r->p, r->len + 1);
+      r->p = r->line = r->buf;
+    }
+
+    /* Grow for expressions larger than half the buffer */
+    if (r->cap - r->len < r->cap / 2) {
+      r->cap *= 2;
+      r->buf = realloc(r->buf, r->cap + 1);
+      r->p = r->line = r->buf;
+    }
+
+    size_t n = fread(r->buf + r->len, 1, r->cap - r->len, r->file);
+    if (n == 0) { r->file = NULL; }
+    r->len += n;
+    r->buf[r->len] = '\0';
+  }
+}
+
+/* Read the next top-level expression, or NULL at the end of input */
+lval* lread_next(lreader* r) {
+  lread_fill(r);
+  lread_space(r);
+  if (*r->p == '\0') { return NULL; }
+  if (!lread_start_p(*r->p)) { return lread_error(r, lread_expected('\0')); }
+  return lread_expr(r);
+}
+
+
+/* --- lenv functions --- */
+
+lenv* lenv_new(void) {
+  lenv* e = lenv_alloc();
+  e->refs = 1;
+  e->par = NULL;
+  e->dyn = NULL;
+  e->extended = 0;
+  e->count = 0;
+  e->cap = 0;
+  e->syms = NULL;
+  e->vals = NULL;
+  e->size = 0;
+  e->table = NULL;
+  return e;
+}
+
+void lenv_del(lenv* e) {
+#ifdef LISPY_GC
+  /* Unreachable environments are freed by the collector */
+  (void)e;
+#else
+  /* Parents are released in a loop as closures can chain many frames */
+  while (e && (--e->refs == 0 || lenv_unlink(e, 0))) {
+    lenv* par = e->par;
+    for (int i = 0; i < e->count; i++) {
+      lval_del(e->vals[i]);
+    }
+    lenv_free(e);
+    e = par;
+  }
+#endif
+}
+
+/* Count the references to e from closures in v, looking only through */
+/* values held by nothing else, and within lists only if deep is set. */
+/* If cut is set those references are dropped.                        */
+int lenv_closes(lenv* e, lval* v, int deep, int cut) {
+  if (LFIX_P(v) || v->refs != 1) { return 0; }
+
+  int n = 0;
+  switch (v->type) {
+  case LVAL_FUN:
+    if (LBUILTIN_P(v) || v->env->refs != 1) { break; }
+    if (v->env->par == e) {
+      if (cut) { v->env->par = NULL; }
+      n++;
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; deep && i < v->count; i++) {
+      n += lenv_closes(e, v->cell[i], deep, cut);
+    }
+    break;
+  default: break;
+  }
+  return n;
+}
+
+/* Check if every reference left to e is from a closure bound in e     */
+/* itself, as when a lambda is stored in the frame it was made in. As */
+/* the cycle would keep e alive forever, drop those references and    */
+/* give 1 so that e is freed.                                         */
+int lenv_unlink(lenv* e, int deep) {
+  if (!deep && e->refs > e->count) { return 0; }
+
+  int n = 0;
+  for (int i = 0; i < e->count && n < e->refs; i++) {
+    n += lenv_closes(e, e->vals[i], deep, 0);
+  }
+  if (n != e->refs) { return 0; }
+
+  for (int i = 0; i < e->count; i++) {
+    lenv_closes(e, e->vals[i], deep, 1);
+  }
+  e->refs = 0;
+  return 1;
+}
+
+/* Release the frame of a call which has returned. Unlike lenv_del */
+/* this also finds closures held within lists bound in it, which   */
+/* is too slow to do every time a reference is dropped.            */
+void lenv_leave(lenv* e) {
+#ifdef LISPY_GC
+  (void)e;
+#else
+  if (--e->refs == 0 || lenv_unlink(e, 1)) {
+    e->refs = 1;
+    lenv_del(e);
+  }
+#endif
+}
+
+lenv* lenv_ref(lenv* e) {
+  if (e) { e->refs++; }
+  return e;
+}
+
+/* Insert entry i into the hash table, which must have a free slot */
+void lenv_index(lenv* e, int i) {
+  int mask = e->size - 1;
+  int s = e->syms[i]->hash & mask;
+  while (e->table[s]) { s = (s + 1) & mask; }
+  e->table[s] = i + 1;
+}
+
+/* Rebuild the hash table so that it is at most half full */
+void lenv_rehash(lenv* e) {
+  e->size = e->size ? e->size * 2 : LENV_SMALL * 4;
+  free(e->table);
+  e->table = calloc(e->size, sizeof(int));
+  for (int i = 0; i < e->count; i++) { lenv_index(e, i); }
+}
+
+/* Find the index of k in e alone, or -1 if it is not bound there */
+int lenv_find(lenv* e, lsym* k) {
+
+  /* Large environments probe the hash table */
+  if (e->table) {
+    int mask = e->size - 1;
+    for (int s = k->hash & mask; e->table[s]; s = (s + 1) & mask) {
+      if (e->syms[e->table[s] - 1] == k) { return e->table[s] - 1; }
+    }
+    return -1;
+  }
+
+  /* Small ones, such as lambda frames, are scanned */
+  for (int i = 0; i < e->count; i++) {
+    if (e->syms[i] == k) { return i; }
+  }
+  return -1;
+}
+
+/* Find the value bound to k in the frames lexically enclosing e, */
+/* without copying it, or NULL if unbound there                    */
+lval* lenv_search_frames(lenv* e, lsym* k) {
+  for (lenv* f = e; f && f != lenv_global; f = f->par) {
+    int i = lenv_find(f, k);
+    if (i >= 0) { return f->vals[i]; }
+  }
+  return NULL;
+}
+
+/* Find the value bound to k without copying it, or NULL if unbound. */
+/* Frames lexically enclosing e are searched, then the globals,      */
+/* remembering where k was found in cache if given                   */
+lval* lenv_search(lenv* e, lsym* k, int* cache) {
+  lval* x = lenv_search_frames(e, k);
+  if (x) { return x; }
+
+  /* Global entries never move, so a cached index only needs checking */
+  lenv* g = lenv_global;
+  if (cache && *cache >= 0 && *cache < g->count && g->syms[*cache] == k) {
+    return g->vals[*cache];
+  }
+  int i = lenv_find(g, k);
+  if (i >= 0) {
+    if (cache) { *cache = i; }
+    return g->vals[i];
+  }
+  return NULL;
+}
+
+/* As lenv_search, but before the globals searching the scopes of the */
+/* running callers too. Compiled code does not need this, but         */
+/* Q-Expressions passed down to other functions and evaluated there   */
+/* rely on it                                                         */
+lval* lenv_lookup(lenv* e, lval* k) {
+  lval* x = lenv_search_frames(e, k->sym);
+  if (x) { return x; }
+
+  /* Callers only need searching if some frame binds k at all */
+  if (k->sym->frames) {
+    for (lenv* d = e->dyn; d; d = d->dyn) {
+      x = lenv_search_frames(d, k->sym);
+      if (x) { return x; }
+    }
+  }
+  return lenv_search(lenv_global, k->sym, NULL);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  /* If symbol is found return a copy of the value, otherwise error */
+  lval* v = lenv_lookup(e, k);
+  if (v) {
+    return lval_copy(v);
+  } else {
+    return lval_err("Unboud symbol '%s'", k->sym->name);
+  }
+}
+
+lenv* lenv_copy(lenv* e) {
+  lenv* n = lenv_alloc();
+  n->refs = 1;
+  n->par = lenv_ref(e->par);
+  n->dyn = NULL;
+  n->extended = e->extended;
+  n->count = e->count;
+  n->cap = e->count;
+  n->syms = lcells_alloc(n->count);
+  n->vals = lcells_alloc(n->count);
+  for (int i = 0; i < e->count; i++) {
+    n->syms[i] = e->syms[i];
+    n->syms[i]->frames++;
+    n->vals[i] = lval_copy(e->vals[i]);
+  }
+
+  /* Entries keep their indices so the table can be copied as is */
+  n->size = e->size;
+  n->table = NULL;
+  if (e->table) {
+    n->table = malloc(sizeof(int) * n->size);
+    memcpy(n->table, e->table, sizeof(int) * n->size);
+  }
+  return n;
+}
+
+/* Check if lambda environments x and y close over the same scope */
+/* and bind the same arguments given so far                       */
+int lenv_eq(lenv* x, lenv* y) {
+  if (x->par != y->par || x->count != y->count) { return 0; }
+  for (int i = 0; i < x->count; i++) {
+    if (x->syms[i] != y->syms[i]) { return 0; }
+    if (!lval_eq(x->vals[i], y->vals[i])) { return 0; }
+  }
+  return 1;
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+  /* Put value in the global environment */
+  lenv_put(lenv_global, k, v);
+}
+
+void lenv_put(lenv* e, lval* k, lval*v) {
+
+  /* If variable already exists replace it with the one supplied */
+  int i = lenv_find(e, k->sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    return;
+  }
+
+  /* If no existing entry found, make space for new entry */
+  if (e->count == e->cap) {
+    int cap = e->cap ? e->cap * 2 : 4;
+    e->syms = lcells_resize(e->syms, e->cap, cap);
+    e->vals = lcells_resize(e->vals, e->cap, cap);
+    e->cap = cap;
+  }
+  e->count++;
+
+  /* Copy contents of lval and share the interned symbol */
+  e->vals[e->count - 1] = lval_copy(v);
+  e->syms[e->count - 1] = k->sym;
+  if (e != lenv_global) { k->sym->frames++; }
+
+  /* Index the new entry once the environment is no longer small */
+  if (e->count > LENV_SMALL) {
+    if (e->count * 2 > e->size) {
+      lenv_rehash(e);
+    } else {
+      lenv_index(e, e->count - 1);
+    }
+  }
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+void lenv_add_prim(lenv* e, char* name, lprim func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_prim(func);
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+void lenv_add_builtins(lenv* e) {
+  /* List functions */
+  lenv_add_prim(e, "list", builtin_list);
+  lenv_add_prim(e, "head", builtin_head);
+  lenv_add_prim(e, "tail", builtin_tail);
+  lenv_add_prim(e, "eval", builtin_eval);
+  lenv_add_prim(e, "join", builtin_join);
+  lenv_add_prim(e, "len",     builtin_len);
+  lenv_add_prim(e, "nth",     builtin_nth);
+  lenv_add_prim(e, "last",    builtin_last);
+  lenv_add_prim(e, "take",    builtin_take);
+  lenv_add_prim(e, "drop",    builtin_drop);
+  lenv_add_prim(e, "split",   builtin_split);
+  lenv_add_prim(e, "elem",    builtin_elem);
+  lenv_add_prim(e, "map",     builtin_map);
+  lenv_add_prim(e, "filter",  builtin_filter);
+  lenv_add_prim(e, "foldl",   builtin_foldl);
+  lenv_add_prim(e, "sum",     builtin_sum);
+  lenv_add_prim(e, "product", builtin_product);
+  lenv_add_prim(e, "unpack",  builtin_apply);
+  lenv_add_prim(e, "apply",   builtin_apply);
+
+  /* Map functions */
+  lenv_add_prim(e, "map-new",  builtin_map_new);
+  lenv_add_prim(e, "map-get",  builtin_map_get);
+  lenv_add_prim(e, "map-has",  builtin_map_has);
+  lenv_add_prim(e, "map-put",  builtin_map_put);
+  lenv_add_prim(e, "map-del",  builtin_map_del);
+  lenv_add_prim(e, "map-len",  builtin_map_len);
+  lenv_add_prim(e, "map-keys", builtin_map_keys);
+  lenv_add_prim(e, "map-vals", builtin_map_vals);
+  lenv_add_prim(e, "map-fold", builtin_map_fold);
+
+  /* Vector functions */
+  lenv_add_prim(e, "vec",        builtin_vec);
+  lenv_add_prim(e, "vec-list",   builtin_vec_list);
+  lenv_add_prim(e, "vec-range",  builtin_vec_range);
+  lenv_add_prim(e, "vec-len",    builtin_vec_len);
+  lenv_add_prim(e, "vec-nth",    builtin_vec_nth);
+  lenv_add_prim(e, "vec-sum",    builtin_vec_sum);
+  lenv_add_prim(e, "vec-min",    builtin_vec_min);
+  lenv_add_prim(e, "vec-max",    builtin_vec_max);
+  lenv_add_prim(e, "vec-dot",    builtin_vec_dot);
+  lenv_add_prim(e, "vec+",       builtin_vec_add);
+  lenv_add_prim(e, "vec-",       builtin_vec_sub);
+  lenv_add_prim(e, "vec*",       builtin_vec_mul);
+  lenv_add_prim(e, "vec-map",    builtin_vec_map);
+  lenv_add_prim(e, "vec-filter", builtin_vec_filter);
+
+  /* Memoization functions */
+  lenv_add_prim(e, "memo",       builtin_memo);
+  lenv_add_prim(e, "memo-stats", builtin_memo_stats);
+
+  /* Set true before loading the prelude to use its list functions */
+  /* written in Lispy instead of the builtins above                */
+  lval* k = lval_sym("lispy-lists");
+  lval* v = lval_num(0);
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+
+  /* Mathematical functions */
+  lenv_add_prim(e, "+", builtin_add);
+  lenv_add_prim(e, "-", builtin_sub);
+  lenv_add_prim(e, "*", builtin_mul);
+  lenv_add_prim(e, "/", builtin_div);
+  lenv_add_prim(e, "int", builtin_int);
+  lenv_add_prim(e, "float", builtin_float);
+
+  /* Variable functions */
+  lenv_add_prim(e, "def", builtin_def);
+  lenv_add_prim(e, "\\", builtin_lambda);
+  lenv_add_prim(e, "fun", builtin_fun);
+  lenv_add_prim(e, "def", builtin_def);
+  lenv_add_prim(e, "=", builtin_put);
+
+  /* Comparison functions */
+  lenv_add_prim(e, "if", builtin_if);
+  lenv_add_prim(e, "==", builtin_eq);
+  lenv_add_prim(e, "!=", builtin_ne);
+  lenv_add_prim(e, ">",  builtin_gt);
+  lenv_add_prim(e, "<",  builtin_lt);
+  lenv_add_prim(e, ">=", builtin_ge);
+  lenv_add_prim(e, "<=", builtin_le);
+
+  /* Control functions */
+  lenv_add_prim(e, "let",    builtin_let);
+  lenv_add_prim(e, "do",     builtin_do);
+  lenv_add_prim(e, "select", builtin_select);
+  lenv_add_prim(e, "cond",   builtin_select);
+  lenv_add_prim(e, "case",   builtin_case);
+  lenv_add_prim(e, "and",    builtin_and);
+  lenv_add_prim(e, "or",     builtin_or);
+
+  /* Iteration functions */
+  lenv_add_prim(e, "while",   builtin_while);
+  lenv_add_prim(e, "dotimes", builtin_dotimes);
+  lenv_add_prim(e, "loop",    builtin_loop);
+  lenv_add_prim(e, "recur",   builtin_recur);
+
+  /* String functions */
+  lenv_add_prim(e, "load",  builtin_load);
+  lenv_add_prim(e, "error", builtin_error);
+  lenv_add_prim(e, "catch", builtin_catch);
+  lenv_add_prim(e, "print", builtin_print);
+  lenv_add_prim(e, "show",  builtin_show);
+
+}
+
+
+/* --- maps --- */
+
+lmap* lmap_new(void) {
+  lmap* m = malloc(sizeof(lmap));
+  m->newer = NULL;
+  m->count = 0;
+  m->cap = 0;
+  m->keys = NULL;
+  m->vals = NULL;
+  m->hashes = NULL;
+  m->size = 0;
+  m->table = NULL;
+  return m;
+}
+
+/* Free the memory of m itself, but not of its keys and values */
+void lmap_free(lmap* m) {
+  free(m->keys);
+  free(m->vals);
+  free(m->hashes);
+  free(m->table);
+  free(m);
+}
+
+/* Release the keys and values of m, which an old version may lack */
+void lmap_release(lmap* m) {
+  for (int i = 0; i < m->count; i++) {
+    lval_del(m->keys[i]);
+    if (m->vals[i]) { lval_del(m->vals[i]); }
+  }
+}
+
+/* Index entry i in the table */
+void lmap_index(lmap* m, int i) {
+  int mask = m->size - 1;
+  int s = m->hashes[i] & mask;
+  while (m->table[s]) { s = (s + 1) & mask; }
+  m->table[s] = i + 1;
+}
+
+/* Rebuild the table with room for twice the entries */
+void lmap_rehash(lmap* m) {
+  free(m->table);
+  m->size = 16;
+  while (m->size < m->cap * 2) { m->size *= 2; }
+  m->table = calloc(m->size, sizeof(int));
+  for (int i = 0; i < m->count; i++) { lmap_index(m, i); }
+}
+
+lmap* lmap_copy(lmap* m) {
+  lmap* n = lmap_new();
+  n->count = m->count;
+  n->cap = m->count;
+  n->keys = malloc(sizeof(lval*) * n->cap);
+  n->vals = malloc(sizeof(lval*) * n->cap);
+  n->hashes = malloc(sizeof(unsigned long) * n->cap);
+  for (int i = 0; i < m->count; i++) {
+    n->keys[i] = lval_copy(m->keys[i]);
+    n->vals[i] = lval_copy(m->vals[i]);
+    n->hashes[i] = m->hashes[i];
+  }
+  lmap_rehash(n);
+  return n;
+}
+
+/* Slot of the table indexing key k with hash h, or of the empty slot */
+/* where it would go                                                  */
+int lmap_slot(lmap* m, lval* k, unsigned long h) {
+  int mask = m->size - 1;
+  int s = h & mask;
+  while (m->table[s]) {
+    int i = m->table[s] - 1;
+    if (m->hashes[i] == h && lval_eq(m->keys[i], k)) { break; }
+    s = (s + 1) & mask;
+  }
+  return s;
+}
+
+/* Index of the entry for key k with hash h, or -1 */
+int lmap_find(lmap* m, lval* k, unsigned long h) {
+  if (!m->count) { return -1; }
+  return m->table[lmap_slot(m, k, h)] - 1;
+}
+
+void lmap_put(lmap* m, lval* k, lval* v) {
+  unsigned long h = lval_hash(k);
+  int i = lmap_find(m, k, h);
+  if (i >= 0) {
+    lval_del(m->vals[i]);
+    m->vals[i] = lval_copy(v);
+    return;
+  }
+
+  if (m->count == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 8;
+    m->keys = realloc(m->keys, sizeof(lval*) * m->cap);
+    m->vals = realloc(m->vals, sizeof(lval*) * m->cap);
+    m->hashes = realloc(m->hashes, sizeof(unsigned long) * m->cap);
+  }
+  i = m->count++;
+  m->keys[i] = lval_copy(k);
+  m->vals[i] = lval_copy(v);
+  m->hashes[i] = h;
+
+  if (m->count * 2 > m->size) {
+    lmap_rehash(m);
+  } else {
+    lmap_index(m, i);
+  }
+}
+
+void lmap_remove(lmap* m, lval* k) {
+  if (!m->count) { return; }
+  int mask = m->size - 1;
+  int s = lmap_slot(m, k, lval_hash(k));
+  int i = m->table[s] - 1;
+  if (i < 0) { return; }
+
+  lval_del(m->keys[i]);
+  lval_del(m->vals[i]);
+
+  /* Close the gap in the table by moving back entries probed past it */
+  int j = s;
+  while (1) {
+    j = (j + 1) & mask;
+    if (!m->table[j]) { break; }
+    int home = m->hashes[m->table[j] - 1] & mask;
+    int between = (s < j) ? (s < home && home <= j) : (s < home || home <= j);
+    if (!between) {
+      m->table[s] = m->table[j];
+      s = j;
+    }
+  }
+  m->table[s] = 0;
+
+  /* Move the last entry into the removed one's place */
+  int last = --m->count;
+  if (i != last) {
+    int t = m->hashes[last] & mask;
+    while (m->table[t] != last + 1) { t = (t + 1) & mask; }
+    m->table[t] = i + 1;
+    m->keys[i] = m->keys[last];
+    m->vals[i] = m->vals[last];
+    m->hashes[i] = m->hashes[last];
+  }
+}
+
+/* Put v for key k in m, or remove k if v is NULL, first noting in undo */
+/* the old value of k, unless undo is NULL                              */
+void lmap_set(lmap* m, lmap* undo, lval* k, lval* v) {
+  if (undo) {
+    if (undo->count == undo->cap) {
+      undo->cap = undo->cap ? undo->cap * 2 : 4;
+      undo->keys = realloc(undo->keys, sizeof(lval*) * undo->cap);
+      undo->vals = realloc(undo->vals, sizeof(lval*) * undo->cap);
+      undo->table = realloc(undo->table, sizeof(int) * undo->cap);
+    }
+    int i = lmap_find(m, k, lval_hash(k));
+    undo->keys[undo->count] = lval_copy(k);
+    undo->vals[undo->count] = (i >= 0) ? lval_copy(m->vals[i]) : NULL;
+    undo->table[undo->count] = i;
+    undo->count++;
+  }
+  if (v) { lmap_put(m, k, v); } else { lmap_remove(m, k); }
+}
+
+/* Swap entries i and j of m */
+void lmap_swap(lmap* m, int i, int j) {
+  int mask = m->size - 1;
+  int s = m->hashes[i] & mask;
+  while (m->table[s] != i + 1) { s = (s + 1) & mask; }
+  int t = m->hashes[j] & mask;
+  while (m->table[t] != j + 1) { t = (t + 1) & mask; }
+  m->table[s] = j + 1;
+  m->table[t] = i + 1;
+
+  lval* k = m->keys[i]; m->keys[i] = m->keys[j]; m->keys[j] = k;
+  lval* v = m->vals[i]; m->vals[i] = m->vals[j]; m->vals[j] = v;
+  unsigned long h = m->hashes[i];
+  m->hashes[i] = m->hashes[j];
+  m->hashes[j] = h;
+}
+
+/* Undo on m, the entries of the newer version, the changes noted in */
+/* undo, last first, so that each puts back the entry order too      */
+void lmap_undo(lmap* m, lmap* undo) {
+  for (int n = undo->count - 1; n >= 0; n--) {
+    lval* k = undo->keys[n];
+    int i = undo->table[n];
+
+    /* An added key was put last, and a removed one had the last */
+    /* entry moved into its place                                */
+    if (i < 0) {
+      lmap_remove(m, k);
+    } else if (lmap_find(m, k, lval_hash(k)) >= 0) {
+      lmap_put(m, k, undo->vals[n]);
+    } else {
+      lmap_put(m, k, undo->vals[n]);
+      if (i != m->count - 1) { lmap_swap(m, i, m->count - 1); }
+    }
+  }
+}
+
+/* The entries of map v. An old version gets its own back by copying */
+/* those of the newest and undoing the changes made since            */
+lmap* lmap_of(lval* v) {
+  lmap* d = v->map;
+  if (!d->newer) { return d; }
+
+  int n = 0;
+  lval* w = v;
+  while (w->map->newer) { w = w->map->newer; n++; }
+  lmap** undos = malloc(sizeof(lmap*) * n);
+  n = 0;
+  for (w = v; w->map->newer; w = w->map->newer) { undos[n++] = w->map; }
+
+  lmap* m = lmap_copy(w->map);
+  while (n--) { lmap_undo(m, undos[n]); }
+  free(undos);
+
+  v->map = m;
+  lmap_release(d);
+  lval_del(d->newer);
+  lmap_free(d);
+  return m;
+}
+
+/* A new version of map v to change in place, and in undo where to note */
+/* how to undo the changes for v, or NULL if v is not shared. Either    */
+/* way this takes O(1), as a shared v gives its entries to the new one  */
+lval* lval_map_edit(lval* v, lmap** undo) {
+  lmap* m = lmap_of(v);
+  if (v->refs == 1) {
+    *undo = NULL;
+    return lval_copy(v);
+  }
+
+  lval* x = lval_alloc(LVAL_MAP);
+  x->map = m;
+  v->map = lmap_new();
+  v->map->newer = lval_copy(x);
+  *undo = v->map;
+  return x;
+}
+
+
+/* --- vectors --- */
+
+/* Vectors hold Numbers as unboxed longs or, once any element is a  */
+/* Float, all their elements as unboxed doubles. Bignums have no     */
+/* place in them and are refused with an error saying so             */
+
+/* The kernels below work four elements at a time with independent */
+/* accumulators, which lets the compiler use SIMD instructions even */
+/* where it would not vectorize the plain loops. None of them may   */
+/* overflow a signed long: they either split the elements so that   */
+/* the sums cannot overflow or wrap around unsigned and report it   */
+
+/* Sum a exactly as hi * 2^32 + lo, adding the low halves of the    */
+/* elements unsigned and the high halves signed. Neither can        */
+/* overflow for fewer than 2^31 elements                            */
+void lvec_sum(long* restrict a, int n, long* hi, unsigned long* lo) {
+  long h[4] = { 0, 0, 0, 0 };
+  unsigned long l[4] = { 0, 0, 0, 0 };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    h[0] += a[i] >> 32;     l[0] += (unsigned long)a[i] & 0xffffffff;
+    h[1] += a[i + 1] >> 32; l[1] += (unsigned long)a[i + 1] & 0xffffffff;
+    h[2] += a[i + 2] >> 32; l[2] += (unsigned long)a[i + 2] & 0xffffffff;
+    h[3] += a[i + 3] >> 32; l[3] += (unsigned long)a[i + 3] & 0xffffffff;
+  }
+  for (; i < n; i++) {
+    h[0] += a[i] >> 32; l[0] += (unsigned long)a[i] & 0xffffffff;
+  }
+  *hi = h[0] + h[1] + h[2] + h[3];
+  *lo = l[0] + l[1] + l[2] + l[3];
+}
+
+/* Dot product of a and b, setting over if any product or partial */
+/* sum does not fit in a long                                     */
+long lvec_dot(long* restrict a, long* restrict b, int n, int* over) {
+  long s[4] = { 0, 0, 0, 0 };
+  long p[4];
+  int o = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    o |= __builtin_mul_overflow(a[i], b[i], &p[0]);
+    o |= __builtin_mul_overflow(a[i + 1], b[i + 1], &p[1]);
+    o |= __builtin_mul_overflow(a[i + 2], b[i + 2], &p[2]);
+    o |= __builtin_mul_overflow(a[i + 3], b[i + 3], &p[3]);
+    o |= __builtin_add_overflow(s[0], p[0], &s[0]);
+    o |= __builtin_add_overflow(s[1], p[1], &s[1]);
+    o |= __builtin_add_overflow(s[2], p[2], &s[2]);
+    o |= __builtin_add_overflow(s[3], p[3], &s[3]);
+  }
+  for (; i < n; i++) {
+    o |= __builtin_mul_overflow(a[i], b[i], &p[0]);
+    o |= __builtin_add_overflow(s[0], p[0], &s[0]);
+  }
+  o |= __builtin_add_overflow(s[0], s[1], &s[0]);
+  o |= __builtin_add_overflow(s[2], s[3], &s[2]);
+  o |= __builtin_add_overflow(s[0], s[2], &s[0]);
+  *over = o;
+  return s[0];
+}
+
+/* The elementwise kernels compute in unsigned longs, which wrap    */
+/* around, and collect in o the sign bits that mark an overflow     */
+#define LVEC_ADD(r, i, y, o) {                                       \
+    unsigned long x_ = r[i], y_ = y, z_ = x_ + y_;                  \
+    o |= (x_ ^ z_) & (y_ ^ z_); r[i] = z_; }
+#define LVEC_SUB(r, i, y, o) {                                       \
+    unsigned long x_ = r[i], y_ = y, z_ = x_ - y_;                  \
+    o |= (x_ ^ y_) & (x_ ^ z_); r[i] = z_; }
+
+/* Apply OP with the elements y0 to y3 to the four elements of r from i */
+#define LVEC_OP4(r, i, OP, y0, y1, y2, y3, o) {                      \
+    OP(r, i, y0, o); OP(r, i + 1, y1, o);                           \
+    OP(r, i + 2, y2, o); OP(r, i + 3, y3, o); }
+
+/* r = r op b elementwise, returning nonzero if any element overflowed */
+int lvec_op(long* restrict r, long* restrict b, int n, lopr_t op) {
+  unsigned long o = 0;
+  int m = 0;
+  int i = 0;
+  switch (op) {
+  case LOPR_ADD:
+    for (; i + 4 <= n; i += 4) {
+      LVEC_OP4(r, i, LVEC_ADD, b[i], b[i + 1], b[i + 2], b[i + 3], o);
+    }
+    for (; i < n; i++) { LVEC_ADD(r, i, b[i], o); }
+    break;
+  case LOPR_SUB:
+    for (; i + 4 <= n; i += 4) {
+      LVEC_OP4(r, i, LVEC_SUB, b[i], b[i + 1], b[i + 2], b[i + 3], o);
+    }
+    for (; i < n; i++) { LVEC_SUB(r, i, b[i], o); }
+    break;
+  case LOPR_MUL:
+    for (; i < n; i++) { m |= __builtin_mul_overflow(r[i], b[i], &r[i]); }
+    break;
+  default: break;
+  }
+  return m || (o >> 63);
+}
+
+/* r = r op b for each element of r, returning nonzero on overflow */
+int lvec_op_num(long* restrict r, long b, int n, lopr_t op) {
+  unsigned long o = 0;
+  int m = 0;
+  int i = 0;
+  switch (op) {
+  case LOPR_ADD:
+    for (; i + 4 <= n; i += 4) { LVEC_OP4(r, i, LVEC_ADD, b, b, b, b, o); }
+    for (; i < n; i++) { LVEC_ADD(r, i, b, o); }
+    break;
+  case LOPR_SUB:
+    for (; i + 4 <= n; i += 4) { LVEC_OP4(r, i, LVEC_SUB, b, b, b, b, o); }
+    for (; i < n; i++) { LVEC_SUB(r, i, b, o); }
+    break;
+  case LOPR_MUL:
+    for (; i < n; i++) { m |= __builtin_mul_overflow(r[i], b, &r[i]); }
+    break;
+  default: break;
+  }
+  return m || (o >> 63);
+}
+
+/* Floats go to infinity rather than overflow, so need no checks. The */
+/* sums again keep four accumulators, so may round differently from   */
+/* adding the elements in order                                       */
+
+double lvec_fsum(double* restrict a, int n) {
+  double s[4] = { 0, 0, 0, 0 };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s[0] += a[i]; s[1] += a[i + 1]; s[2] += a[i + 2]; s[3] += a[i + 3];
+  }
+  for (; i < n; i++) { s[0] += a[i]; }
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+double lvec_fdot(double* restrict a, double* restrict b, int n) {
+  double s[4] = { 0, 0, 0, 0 };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s[0] += a[i] * b[i];
+    s[1] += a[i + 1] * b[i + 1];
+    s[2] += a[i + 2] * b[i + 2];
+    s[3] += a[i + 3] * b[i + 3];
+  }
+  for (; i < n; i++) { s[0] += a[i] * b[i]; }
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+/* r = r op b elementwise */
+void lvec_fop(double* restrict r, double* restrict b, int n, lopr_t op) {
+  switch (op) {
+  case LOPR_ADD: for (int i = 0; i < n; i++) { r[i] += b[i]; } break;
+  case LOPR_SUB: for (int i = 0; i < n; i++) { r[i] -= b[i]; } break;
+  case LOPR_MUL: for (int i = 0; i < n; i++) { r[i] *= b[i]; } break;
+  default: break;
+  }
+}
+
+/* r = r op b for each element of r */
+void lvec_fop_num(double* restrict r, double b, int n, lopr_t op) {
+  switch (op) {
+  case LOPR_ADD: for (int i = 0; i < n; i++) { r[i] += b; } break;
+  case LOPR_SUB: for (int i = 0; i < n; i++) { r[i] -= b; } break;
+  case LOPR_MUL: for (int i = 0; i < n; i++) { r[i] *= b; } break;
+  default: break;
+  }
+}
+
+/* Fill r with the n elements of Vector v, or n copies of the number */
+/* v, as doubles                                                    */
+void lvec_dbls(double* r, lval* v, int n) {
+  if (LTYPE(v) != LVAL_VEC) {
+    double d = LDBL(v);
+    for (int i = 0; i < n; i++) { r[i] = d; }
+  } else if (v->floats) {
+    if (n) { memcpy(r, v->dbls, sizeof(double) * n); }
+  } else {
+    for (int i = 0; i < n; i++) { r[i] = v->nums[i]; }
+  }
+}
+
+/* Make Vector v of Numbers hold Floats, of which only the first n */
+/* are filled in so far                                            */
+void lvec_promote(lval* v, int n) {
+  double* d = v->count ? malloc(sizeof(double) * v->count) : NULL;
+  for (int i = 0; i < n; i++) { d[i] = v->nums[i]; }
+  free(v->nums);
+  v->dbls = d;
+  v->floats = 1;
+}
+
+/* Element i of Vector v as a Number or Float */
+lval* lvec_nth(lval* v, int i) {
+  return v->floats ? lval_dbl(v->dbls[i]) : lval_num(v->nums[i]);
+}
+
+
+/* --- bignums --- */
+
+/* An integer as sign and magnitude, viewing the limbs of a Bignum */
+/* or holding those of a Number in buf                             */
+typedef struct {
+  int neg;
+  int n;
+  uint32_t* d;
+  uint32_t buf[LBIG_LONG_LIMBS];
+} lint;
+
+void lint_of(lint* a, lval* v) {
+  if (LTYPE(v) == LVAL_BIG) {
+    a->neg = v->count < 0;
+    a->n = abs(v->count);
+    a->d = v->limbs;
+    return;
+  }
+  long x = LNUM(v);
+  unsigned long m = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  a->neg = x < 0;
+  a->n = 0;
+  a->d = a->buf;
+  while (m) {
+    a->buf[a->n++] = (uint32_t)m;
+    m = (m >> 16) >> 16;
+  }
+}
+
+int lmag_cmp(uint32_t* a, int na, uint32_t* b, int nb) {
+  if (na != nb) { return na < nb ? -1 : 1; }
+  for (int i = na - 1; i >= 0; i--) {
+    if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+/* r = a + b for na >= nb, with r of na + 1 limbs */
+void lmag_add(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  uint64_t c = 0;
+  int i = 0;
+  for (; i < nb; i++) {
+    c += (uint64_t)a[i] + b[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  for (; i < na; i++) {
+    c += a[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  r[na] = (uint32_t)c;
+}
+
+/* r = a - b for a >= b, with r of na limbs */
+void lmag_sub(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  uint64_t borrow = 0;
+  int i = 0;
+  for (; i < nb; i++) {
+    uint64_t t = (uint64_t)a[i] - b[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = (t >> 32) & 1;
+  }
+  for (; i < na; i++) {
+    uint64_t t = (uint64_t)a[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = (t >> 32) & 1;
+  }
+}
+
+/* r += a, where the sum fits in the nr limbs of r */
+void lmag_add_in(uint32_t* r, int nr, uint32_t* a, int na) {
+  uint64_t c = 0;
+  int i = 0;
+  for (; i < na; i++) {
+    c += (uint64_t)r[i] + a[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  for (; c && i < nr; i++) {
+    c += r[i];
+    r[i] = (uint32_t)c;
+    c >>= 32;
+  }
+}
+
+/* Schoolbook r = a * b, with r of na + nb limbs */
+void lmag_mul(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  memset(r, 0, sizeof(uint32_t) * (na + nb));
+  for (int i = 0; i < na; i++) {
+    uint64_t c = 0;
+    for (int j = 0; j < nb; j++) {
+      c += (uint64_t)a[i] * b[j] + r[i + j];
+      r[i + j] = (uint32_t)c;
+      c >>= 32;
+    }
+    r[i + nb] = (uint32_t)c;
+  }
+}
+
+/* Karatsuba r = a * b, with r of na + nb limbs. Splitting both at m */
+/* limbs, a * b is z2 B^2m + z1 B^m + z0 where z0 = a0 b0 and        */
+/* z2 = a1 b1, while z1 = (a0 + a1)(b0 + b1) - z0 - z2 needs only    */
+/* one more multiplication rather than two.                          */
+void lmag_kmul(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  if (na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
+  }
+  if (nb < LBIG_KARATSUBA) {
+    lmag_mul(r, a, na, b, nb);
+    return;
+  }
+
+  /* When a is much longer multiply b by each nb limbs of it in turn */
+  if (2 * nb <= na) {
+    memset(r, 0, sizeof(uint32_t) * (na + nb));
+    uint32_t* t = malloc(sizeof(uint32_t) * 2 * nb);
+    for (int i = 0; i < na; i += nb) {
+      int k = na - i < nb ? na - i : nb;
+      lmag_kmul(t, a + i, k, b, nb);
+      lmag_add_in(r + i, na + nb - i, t, k + nb);
+    }
+    free(t);
+    return;
+  }
+
+  /* Otherwise nb > m, so each half of both is non-empty */
+  int m = na / 2;
+  uint32_t *a0 = a, *a1 = a + m, *b0 = b, *b1 = b + m;
+  int na1 = na - m, nb1 = nb - m;
+
+  lmag_kmul(r, a0, m, b0, m);
+  lmag_kmul(r + 2 * m, a1, na1, b1, nb1);
+
+  int nsa = na1 + 1;
+  int nsb = (m > nb1 ? m : nb1) + 1;
+  uint32_t* sa = malloc(sizeof(uint32_t) * (nsa + nsb + nsa + nsb));
+  uint32_t* sb = sa + nsa;
+  uint32_t* z1 = sb + nsb;
+  lmag_add(sa, a1, na1, a0, m);
+  if (m >= nb1) { lmag_add(sb, b0, m, b1, nb1); }
+  else { lmag_add(sb, b1, nb1, b0, m); }
+
+  lmag_kmul(z1, sa, nsa, sb, nsb);
+  lmag_sub(z1, z1, nsa + nsb, r, 2 * m);
+  lmag_sub(z1, z1, nsa + nsb, r + 2 * m, na1 + nb1);
+
+  int nz1 = nsa + nsb;
+  while (nz1 && z1[nz1 - 1] == 0) { nz1--; }
+  lmag_add_in(r + m, na + nb - m, z1, nz1);
+  free(sa);
+}
+
+/* q = a / d returning the remainder, for a single limb d */
+uint32_t lmag_div1(uint32_t* q, uint32_t* a, int na, uint32_t d) {
+  uint64_t r = 0;
+  for (int i = na - 1; i >= 0; i--) {
+    r = (r << 32) | a[i];
+    q[i] = (uint32_t)(r / d);
+    r %= d;
+  }
+  return (uint32_t)r;
+}
+
+/* Knuth's long division q = a / b for na >= nb >= 2, where b has no  */
+/* leading zero limb, with q of na - nb + 1 limbs                     */
+void lmag_div(uint32_t* q, uint32_t* a, int na, uint32_t* b, int nb) {
+
+  /* Shift both so that the top bit of b is set, making the estimates */
+  /* of each quotient limb below at most two too large                */
+  int s = __builtin_clz(b[nb - 1]);
+  uint32_t* bn = malloc(sizeof(uint32_t) * (nb + na + 1));
+  uint32_t* an = bn + nb;
+  for (int i = nb - 1; i > 0; i--) {
+    bn[i] = (b[i] << s) | (uint32_t)((uint64_t)b[i - 1] >> (32 - s));
+  }
+  bn[0] = b[0] << s;
+  an[na] = (uint32_t)((uint64_t)a[na - 1] >> (32 - s));
+  for (int i = na - 1; i > 0; i--) {
+    an[i] = (a[i] << s) | (uint32_t)((uint64_t)a[i - 1] >> (32 - s));
+  }
+  an[0] = a[0] << s;
+
+  for (int j = na - nb; j >= 0; j--) {
+    uint64_t top = ((uint64_t)an[j + nb] << 32) | an[j + nb - 1];
+    uint64_t qhat = top / bn[nb - 1];
+    uint64_t rhat = top % bn[nb - 1];
+    while (qhat >> 32
+           || qhat * bn[nb - 2] > ((rhat << 32) | an[j + nb - 2])) {
+      qhat--;
+      rhat += bn[nb - 1];
+      if (rhat >> 32) { break; }
+    }
+
+    /* Subtract qhat * b from the current limbs of a */
+    int64_t k = 0, t;
+    for (int i = 0; i < nb; i++) {
+      uint64_t p = qhat * bn[i];
+      t = (int64_t)an[i + j] - k - (int64_t)(p & 0xFFFFFFFF);
+      an[i + j] = (uint32_t)t;
+      k = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)an[j + nb] - k;
+    an[j + nb] = (uint32_t)t;
+
+    /* If that went below zero qhat was one too large, so add b back */
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q[j]--;
+      uint64_t c = 0;
+      for (int i = 0; i < nb; i++) {
+        c += (uint64_t)an[i + j] + bn[i];
+        an[i + j] = (uint32_t)c;
+        c >>= 32;
+      }
+      an[j + nb] += (uint32_t)c;
+    }
+  }
+  free(bn);
+}
+
+/* The integer of sign neg and n limbs of magnitude d, taking d. As */
+/* a Number if it fits in a long, otherwise as a Bignum             */
+lval* lbig_make(int neg, uint32_t* d, int n) {
+  while (n && d[n - 1] == 0) { n--; }
+  if (n <= LBIG_LONG_LIMBS) {
+    unsigned long m = 0;
+    for (int i = n - 1; i >= 0; i--) { m = ((m << 16) << 16) | d[i]; }
+    if (m <= LONG_MAX || (neg && m == (unsigned long)LONG_MAX + 1)) {
+      free(d);
+      return lval_num(neg ? (long)(0UL - m) : (long)m);
+    }
+  }
+  lval* v = lval_alloc(LVAL_BIG);
+  v->count = neg ? -n : n;
+  v->limbs = d;
+  return v;
+}
+
+/* x op y for integers x and y, where y is not zero for division */
+lval* lbig_op(lval* x, lval* y, lopr_t op) {
+  lint a, b;
+  lint_of(&a, x);
+  lint_of(&b, y);
+  uint32_t* r;
+
+  switch (op) {
+  case LOPR_SUB:
+    b.neg = !b.neg;
+    /* fall through */
+  case LOPR_ADD: {
+    /* Same signs add magnitudes, otherwise the smaller is taken */
+    /* from the larger, which gives the sign                     */
+    lint* p = &a;
+    lint* q = &b;
+    if (a.n < b.n || (a.neg != b.neg && lmag_cmp(a.d, a.n, b.d, b.n) < 0)) {
+      p = &b;
+      q = &a;
+    }
+    r = malloc(sizeof(uint32_t) * (p->n + 1));
+    if (p->neg == q->neg) {
+      lmag_add(r, p->d, p->n, q->d, q->n);
+      return lbig_make(p->neg, r, p->n + 1);
+    }
+    lmag_sub(r, p->d, p->n, q->d, q->n);
+    return lbig_make(p->neg, r, p->n);
+  }
+
+  case LOPR_MUL:
+    if (a.n == 0 || b.n == 0) { return lval_num(0); }
+    r = malloc(sizeof(uint32_t) * (a.n + b.n));
+    lmag_kmul(r, a.d, a.n, b.d, b.n);
+    return lbig_make(a.neg != b.neg, r, a.n + b.n);
+
+  case LOPR_DIV:
+    /* Quotients are truncated towards zero, as for longs */
+    if (lmag_cmp(a.d, a.n, b.d, b.n) < 0) { return lval_num(0); }
+    r = malloc(sizeof(uint32_t) * (a.n - b.n + 1));
+    if (b.n == 1) {
+      lmag_div1(r, a.d, a.n, b.d[0]);
+    } else {
+      lmag_div(r, a.d, a.n, b.d, b.n);
+    }
+    return lbig_make(a.neg != b.neg, r, a.n - b.n + 1);
+
+  default: return lval_num(0);
+  }
+}
+
+/* Compare integers x and y, giving -1, 0 or 1 */
+int lbig_cmp(lval* x, lval* y) {
+  lint a, b;
+  lint_of(&a, x);
+  lint_of(&b, y);
+  if (a.neg != b.neg) { return a.neg ? -1 : 1; }
+  int c = lmag_cmp(a.d, a.n, b.d, b.n);
+  return a.neg ? -c : c;
+}
+
+double lbig_dbl(lval* v) {
+  double x = 0;
+  for (int i = abs(v->count) - 1; i >= 0; i--) {
+    x = x * 4294967296.0 + v->limbs[i];
+  }
+  return v->count < 0 ? -x : x;
+}
+
+/* The integer part of finite x. Scaling by powers of two is exact, */
+/* so the limbs are taken off the top of x one by one               */
+lval* lbig_of_dbl(double x) {
+  int neg = x < 0;
+  if (neg) { x = -x; }
+  int n = 0;
+  double top = x;
+  while (top >= 1) {
+    top /= 4294967296.0;
+    n++;
+  }
+  uint32_t* d = malloc(sizeof(uint32_t) * (n + 1));
+  for (int i = n - 1; i >= 0; i--) {
+    top *= 4294967296.0;
+    d[i] = (uint32_t)top;
+    top -= d[i];
+  }
+  return lbig_make(neg, d, n);
+}
+
+/* Read decimal digits s, nine at a time */
+lval* lbig_read(char* s) {
+  int neg = *s == '-';
+  if (neg) { s++; }
+  int len = strlen(s);
+  uint32_t* d = malloc(sizeof(uint32_t) * (len / 9 + 2));
+  int n = 0;
+
+  for (int i = 0; i < len;) {
+    int k = (len - i) % 9 ? (len - i) % 9 : 9;
+    uint32_t chunk = 0, scale = 1;
+    for (int j = 0; j < k; j++, i++) {
+      chunk = chunk * 10 + (s[i] - '0');
+      scale *= 10;
+    }
+
+    /* d = d * scale + chunk */
+    uint64_t c = chunk;
+    for (int j = 0; j < n; j++) {
+      c += (uint64_t)d[j] * scale;
+      d[j] = (uint32_t)c;
+      c >>= 32;
+    }
+    if (c) { d[n++] = (uint32_t)c; }
+  }
+  return lbig_make(neg, d, n);
+}
+
+/* Print Bignum v by dividing off nine decimal digits at a time */
+void lbig_print(lval* v) {
+  int n = abs(v->count);
+  uint32_t* q = malloc(sizeof(uint32_t) * n);
+  uint32_t* chunks = malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+  int k = 0;
+  memcpy(q, v->limbs, sizeof(uint32_t) * n);
+
+  /* Always take at least one chunk, so there is a leading one */
+  do {
+    chunks[k++] = lmag_div1(q, q, n, 1000000000);
+    while (n && q[n - 1] == 0) { n--; }
+  } while (n);
+
+  if (v->count < 0) { fputc('-', lval_out); }
+  fprintf(lval_out, "%u", chunks[k - 1]);
+  for (int i = k - 2; i >= 0; i--) { fprintf(lval_out, "%09u", chunks[i]); }
+  free(chunks);
+  free(q);
+}
+
+
+/* --- memoization --- */
+
+unsigned long ldbl_hash(double x) {
+  /* Equal zeros have different bits, so hash both as 0.0 */
+  if (x == 0) { x = 0; }
+  uint64_t b;
+  memcpy(&b, &x, sizeof(b));
+  return (unsigned long)(b ^ (b >> 29)) * 2654435761u;
+}
+
+/* Hash of v consistent with lval_eq, so equal values hash the same */
+unsigned long lval_hash(lval* v) {
+  unsigned long h = LTYPE(v);
+  switch (LTYPE(v)) {
+  case LVAL_NUM: return (unsigned long)LNUM(v) * 2654435761u;
+  case LVAL_DBL: return ldbl_hash(v->dbl);
+  case LVAL_BIG:
+    h += v->count;
+    for (int i = 0; i < abs(v->count); i++) { h = h * 31 + v->limbs[i]; }
+    return h;
+  case LVAL_ERR: return lsym_hash(v->err);
+  case LVAL_SYM: return v->sym->hash;
+  case LVAL_STR: return lsym_hash(v->str);
+  case LVAL_FUN:
+    if (LMEMO_P(v)) { return (uintptr_t)v->memo; }
+    if (LBUILTIN_P(v)) { return (uintptr_t)v->prim ^ (uintptr_t)v->builtin; }
+    h = (uintptr_t)v->env->par;
+    for (int i = 0; i < v->env->count; i++) {
+      h = h * 31 + lval_hash(v->env->vals[i]);
+    }
+    return (h * 31 + lval_hash(v->formals)) * 31 + lval_hash(v->body);
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+    for (int i = 0; i < v->count; i++) {
+      h = h * 31 + lval_hash(v->cell[i]);
+    }
+    return h;
+  case LVAL_MAP: {
+    /* Summed so that the order of entries does not matter */
+    lmap* m = lmap_of(v);
+    for (int i = 0; i < m->count; i++) {
+      h += m->hashes[i] * 31 + lval_hash(m->vals[i]);
+    }
+    return h;
+  }
+  case LVAL_VEC:
+    for (int i = 0; i < v->count; i++) {
+      h = h * 31 + (v->floats ? ldbl_hash(v->dbls[i])
+                    : (unsigned long)v->nums[i] * 2654435761u);
+    }
+    return h + v->floats;
+  }
+  return h;
+}
+
+lmemo* lmemo_new(int capacity) {
+  lmemo* m = malloc(sizeof(lmemo));
+  m->capacity = capacity;
+  m->count = 0;
+  m->size = 16;
+  m->table = calloc(m->size, sizeof(lmemo_entry*));
+  m->newest = NULL;
+  m->oldest = NULL;
+  m->hits = 0;
+  m->misses = 0;
+  m->evictions = 0;
+  return m;
+}
+
+/* Unlink entry x from the recently used order */
+void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+  if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+  if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+/* Link entry x in as the most recently used */
+void lmemo_link(lmemo* m, lmemo_entry* x) {
+  x->newer = NULL;
+  x->older = m->newest;
+  if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+  m->newest = x;
+}
+
+void lmemo_entry_del(lmemo_entry* x) {
+  for (int i = 0; i < x->argc; i++) { lval_del(x->argv[i]); }
+  lcells_free(x->argv, x->argc);
+  lval_del(x->result);
+  free(x);
+}
+
+/* Remove the least recently used entry */
+void lmemo_evict(lmemo* m) {
+  lmemo_entry* x = m->oldest;
+  lmemo_entry** p = &m->table[x->hash & (m->size - 1)];
+  while (*p != x) { p = &(*p)->chain; }
+  *p = x->chain;
+  lmemo_unlink(m, x);
+  lmemo_entry_del(x);
+  m->count--;
+  m->evictions++;
+}
+
+/* Double the number of buckets */
+void lmemo_grow(lmemo* m) {
+  int size = m->size * 2;
+  lmemo_entry** table = calloc(size, sizeof(lmemo_entry*));
+  for (lmemo_entry* x = m->newest; x; x = x->older) {
+    x->chain = table[x->hash & (size - 1)];
+    table[x->hash & (size - 1)] = x;
+  }
+  free(m->table);
+  m->table = table;
+  m->size = size;
+}
+
+void lmemo_del(lmemo* m) {
+  while (m->oldest) { lmemo_evict(m); }
+  free(m->table);
+  free(m);
+}
+
+/* Call memoized function f, giving the cached result for arguments */
+/* equal to ones it was called with before                          */
+lval* lmemo_call(lenv* e, lval* f, int argc, lval** argv) {
+  lmemo* m = f->memo;
+
+  unsigned long h = argc;
+  for (int i = 0; i < argc; i++) { h = h * 31 + lval_hash(argv[i]); }
+
+  for (lmemo_entry* x = m->table[h & (m->size - 1)]; x; x = x->chain) {
+    if (x->hash != h || x->argc != argc) { continue; }
+    int i = 0;
+    while (i < argc && lval_eq(x->argv[i], argv[i])) { i++; }
+    if (i < argc) { continue; }
+
+    m->hits++;
+    lmemo_unlink(m, x);
+    lmemo_link(m, x);
+    return lval_copy(x->result);
+  }
+  m->misses++;
+
+  /* Take the arguments first, as the call may move the stack they are */
+  /* on, and only keep results which are not errors                    */
+  lval** args = lcells_alloc(argc);
+  for (int i = 0; i < argc; i++) { args[i] = lval_copy(argv[i]); }
+
+  lval* r = lval_call(e, f->body, argc, args);
+  if (LTYPE(r) == LVAL_ERR || m->capacity <= 0) {
+    for (int i = 0; i < argc; i++) { lval_del(args[i]); }
+    lcells_free(args, argc);
+    return r;
+  }
+
+  if (m->count >= m->capacity) { lmemo_evict(m); }
+  if ((m->count + 1) * 2 > m->size) { lmemo_grow(m); }
+
+  lmemo_entry* x = malloc(sizeof(lmemo_entry));
+  x->hash = h;
+  x->argc = argc;
+  x->argv = args;
+  x->result = lval_copy(r);
+  x->chain = m->table[h & (m->size - 1)];
+  m->table[h & (m->size - 1)] = x;
+  lmemo_link(m, x);
+  m->count++;
+  return r;
+}
+
+
+/* --- bytecode compiler --- */
+
+/* Builtins which may be compiled inline, indexed by lform_t */
+lprim lforms[] = { builtin_if, builtin_eval, builtin_lambda,
+                   builtin_and, builtin_or, builtin_while, builtin_loop,
+                   builtin_select, builtin_case, builtin_let, builtin_do };
+char* lform_name[] = { "if", "eval", "\\", "and", "or", "while", "loop",
+                       "select", "case", "let", "do" };
+
+lcode* lcode_new(void) {
+  lcode* c = malloc(sizeof(lcode));
+  c->refs = 1;
+  c->count = 0;
+  c->ops = NULL;
+  c->nconsts = 0;
+  c->consts = NULL;
+  c->loop = -1;
+  c->formals = NULL;
+  c->outer = NULL;
+  return c;
+}
+
+void lcode_del(lcode* c) {
+  /* Code is shared between copies of a lambda */
+  if (--c->refs) { return; }
+
+  for (int i = 0; i < c->nconsts; i++) {
+    lval_del(c->consts[i]);
+  }
+  free(c->consts);
+  free(c->ops);
+  free(c);
+}
+
+/* Append an instruction or operand, returning its address */
+int lcode_emit(lcode* c, int op) {
+  c->count++;
+  c->ops = realloc(c->ops, sizeof(int) * c->count);
+  c->ops[c->count - 1] = op;
+  return c->count - 1;
+}
+
+/* Store a copy of v as a constant, returning its index */
+int lcode_const(lcode* c, lval* v) {
+  c->nconsts++;
+  c->consts = realloc(c->consts, sizeof(lval*) * c->nconsts);
+  c->consts[c->nconsts - 1] = lval_copy(v);
+  return c->nconsts - 1;
+}
+
+/* Point the jump operand at address a to the next instruction */
+void lcode_patch(lcode* c, int a) {
+  c->ops[a] = c->count;
+}
+
+/* Emit a jump operand to be patched along with those chained before */
+/* it, which are linked through their operands until patched         */
+int lcode_chain(lcode* c, int chain) {
+  return lcode_emit(c, chain);
+}
+
+/* Point every jump operand in chain to the next instruction */
+void lcode_patch_chain(lcode* c, int chain) {
+  while (chain >= 0) {
+    int next = c->ops[chain];
+    lcode_patch(c, chain);
+    chain = next;
+  }
+}
+
+/* Expressions in tail position are compiled with tail set, so that */
+/* their calls replace the current frame rather than nesting it      */
+void lcode_compile_expr(lcode* c, lval* x, int tail);
+void lcode_compile_sexpr(lcode* c, lval* v, int tail);
+
+/* Check if x holds a symbol, looking inside lists */
+int lval_has_sym(lval* x) {
+  if (LTYPE(x) == LVAL_SYM) { return 1; }
+  if (LTYPE(x) != LVAL_QEXPR && LTYPE(x) != LVAL_SEXPR) { return 0; }
+  for (int i = 0; i < x->count; i++) {
+    if (lval_has_sym(x->cell[i])) { return 1; }
+  }
+  return 0;
+}
+
+/* Check if the arguments of call v pass on a Q-Expression holding a */
+/* symbol. The function called may evaluate it expecting to find the */
+/* caller's variables, so such a call must keep the caller's frame.  */
+/* Lambdas made in the arguments close over the frame instead.       */
+int lval_quotes(lval* v) {
+  for (int i = 1; i < v->count; i++) {
+    lval* x = v->cell[i];
+    if (LTYPE(x) == LVAL_QEXPR && lval_has_sym(x)) { return 1; }
+    if (LTYPE(x) != LVAL_SEXPR || x->count == 0) { continue; }
+    if (LTYPE(x->cell[0]) == LVAL_SYM && x->cell[0]->sym == lsym_lambda) {
+      continue;
+    }
+    if (lval_quotes(x)) { return 1; }
+  }
+  return 0;
+}
+
+/* Compile v as a regular function call, which replaces the current */
+/* frame in tail position unless it may need it. 'recur' always can */
+void lcode_compile_call(lcode* c, lval* v, int tail) {
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, v->cell[i], 0);
+  }
+  int recur = LTYPE(v->cell[0]) == LVAL_SYM && v->cell[0]->sym == lsym_recur;
+  lcode_emit(c, tail && (recur || !lval_quotes(v)) ? OP_TAILCALL : OP_CALL);
+  lcode_emit(c, v->count - 1);
+}
+
+/* Check if v looks like a call to sym with Q-Expressions at given args */
+int lcode_is_form(lval* v, lsym* sym, int count, int qfrom) {
+  if (v->count != count) { return 0; }
+  if (LTYPE(v->cell[0]) != LVAL_SYM) { return 0; }
+  if (v->cell[0]->sym != sym) { return 0; }
+  for (int i = qfrom; i < count; i++) {
+    if (LTYPE(v->cell[i]) != LVAL_QEXPR) { return 0; }
+  }
+  return 1;
+}
+
+/* Check if every formal in v is a symbol, as '\\' requires */
+int lcode_is_formals(lval* v) {
+  for (int i = 0; i < v->count; i++) {
+    if (LTYPE(v->cell[i]) != LVAL_SYM) { return 0; }
+  }
+  return 1;
+}
+
+/* Emit a guard for the builtin form, returning its fallback operand */
+int lcode_guard(lcode* c, lval* sym, lform_t form) {
+  lcode_emit(c, OP_GUARD);
+  lcode_emit(c, lcode_const(c, sym));
+  lcode_emit(c, form);
+  int a = lcode_emit(c, -1);
+  lcode_emit(c, -1);
+  return a;
+}
+
+/* Emit a test of the condition on top of the stack, argument arg of */
+/* form, returning the operand to patch with where to go if it is    */
+/* false. The one after it is patched with where to go on an error   */
+int lcode_test(lcode* c, lform_t form, int arg) {
+  lcode_emit(c, OP_TEST);
+  int a = lcode_emit(c, -1);
+  lcode_emit(c, -1);
+  lcode_emit(c, form);
+  lcode_emit(c, arg);
+  return a;
+}
+
+/* Emit a push of the number x */
+void lcode_num(lcode* c, long x) {
+  lval* v = lval_num(x);
+  lcode_emit(c, OP_CONST);
+  lcode_emit(c, lcode_const(c, v));
+  lval_del(v);
+}
+
+/* Emit a push of an error with message msg */
+void lcode_err(lcode* c, char* msg) {
+  lval* v = lval_err("%s", msg);
+  lcode_emit(c, OP_CONST);
+  lcode_emit(c, lcode_const(c, v));
+  lval_del(v);
+}
+
+/* Slot which formal k is bound to in frames of the lambda c is the */
+/* code of, or -1. Formals are bound in order skipping '&', unless  */
+/* one is repeated, in which case none are given a slot             */
+int lcode_slot(lcode* c, lsym* k) {
+  if (!c->formals) { return -1; }
+  int slot = -1;
+  int n = 0;
+  for (int i = 0; i < c->formals->count; i++) {
+    lsym* f = c->formals->cell[i]->sym;
+    if (f == lsym_amp) { continue; }
+    for (int j = 0; j < i; j++) {
+      if (c->formals->cell[j]->sym == f) { return -1; }
+    }
+    if (f == k) { slot = n; }
+    n++;
+  }
+  return slot;
+}
+
+/* Symbols naming formals of this lambda or of those it is written in */
+/* are read from their slot, anything else is looked up               */
+void lcode_compile_sym(lcode* c, lval* x) {
+  int depth = 0;
+  for (lcode* s = c; s; s = s->outer) {
+    int slot = lcode_slot(s, x->sym);
+    if (slot >= 0) {
+      lcode_emit(c, OP_LOCAL);
+      lcode_emit(c, depth);
+      lcode_emit(c, slot);
+      lcode_emit(c, lcode_const(c, x));
+      return;
+    }
+    depth++;
+  }
+
+  lcode_emit(c, OP_LOAD);
+  lcode_emit(c, lcode_const(c, x));
+  lcode_emit(c, -1);
+}
+
+/* (if cond {then} {else}) with both branches evaluated in place */
+void lcode_compile_if(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_IF);
+
+  lcode_compile_expr(c, v->cell[1], 0);
+  int other = lcode_test(c, LFORM_IF, 0);
+  int fail = other + 1;
+
+  lcode_compile_sexpr(c, v->cell[2], tail);
+  lcode_emit(c, OP_JUMP);
+  int end_then = lcode_emit(c, -1);
+
+  lcode_patch(c, other);
+  lcode_compile_sexpr(c, v->cell[3], tail);
+  lcode_emit(c, OP_JUMP);
+  int end_else = lcode_emit(c, -1);
+
+  /* If 'if' has been redefined call whatever it is now */
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+
+  lcode_patch(c, fail);
+  lcode_patch(c, end_then);
+  lcode_patch(c, end_else);
+}
+
+/* (\\ {formals} {body}) compiled ahead of time as a closure over the */
+/* current frame, so that its body can find these formals by slot   */
+void lcode_compile_lambda(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_LAMBDA);
+
+  lval* f = lval_lambda(lval_copy(v->cell[1]), lval_copy(v->cell[2]), c);
+  lcode_emit(c, OP_CLOSURE);
+  lcode_emit(c, lcode_const(c, f));
+  lval_del(f);
+  lcode_emit(c, OP_JUMP);
+  int end = lcode_emit(c, -1);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch(c, end);
+}
+
+/* (eval {expr}) with a literal Q-Expression evaluated in place */
+void lcode_compile_eval(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_EVAL);
+
+  lcode_compile_sexpr(c, v->cell[1], tail);
+  lcode_emit(c, OP_JUMP);
+  int end = lcode_emit(c, -1);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch(c, end);
+}
+
+/* (and x y) or (or x y) giving 1 or 0, with y only evaluated when x */
+/* does not decide the result                                        */
+void lcode_compile_logic(lcode* c, lval* v, lform_t form, int tail) {
+  int generic = lcode_guard(c, v->cell[0], form);
+
+  /* A true x decides 'or', otherwise y is tested */
+  lcode_compile_expr(c, v->cell[1], 0);
+  int first = lcode_test(c, form, 0);
+  int end_first = -1;
+  if (form == LFORM_OR) {
+    lcode_num(c, 1);
+    lcode_emit(c, OP_JUMP);
+    end_first = lcode_emit(c, -1);
+    lcode_patch(c, first);
+  }
+
+  lcode_compile_expr(c, v->cell[2], 0);
+  int second = lcode_test(c, form, 1);
+  lcode_num(c, 1);
+  lcode_emit(c, OP_JUMP);
+  int end_true = lcode_emit(c, -1);
+
+  /* A false x decides 'and' */
+  if (form == LFORM_AND) { lcode_patch(c, first); }
+  lcode_patch(c, second);
+  lcode_num(c, 0);
+  lcode_emit(c, OP_JUMP);
+  int end_false = lcode_emit(c, -1);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+
+  lcode_patch(c, first + 1);
+  lcode_patch(c, second + 1);
+  if (end_first >= 0) { lcode_patch(c, end_first); }
+  lcode_patch(c, end_true);
+  lcode_patch(c, end_false);
+}
+
+/* (while {test} {body}) as a loop within the current code */
+void lcode_compile_while(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_WHILE);
+
+  int start = c->count;
+  lcode_compile_sexpr(c, v->cell[1], 0);
+  int done = lcode_test(c, LFORM_WHILE, 0);
+
+  lcode_compile_sexpr(c, v->cell[2], 0);
+  lcode_emit(c, OP_POP);
+  int fail = lcode_emit(c, -1);
+  lcode_emit(c, OP_JUMP);
+  lcode_emit(c, start);
+
+  lcode_patch(c, done);
+  lval* x = lval_sexpr();
+  lcode_emit(c, OP_CONST);
+  lcode_emit(c, lcode_const(c, x));
+  lval_del(x);
+  lcode_emit(c, OP_JUMP);
+  int end = lcode_emit(c, -1);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+
+  lcode_patch(c, done + 1);
+  lcode_patch(c, fail);
+  lcode_patch(c, end);
+}
+
+/* Check the bindings of a loop are distinct symbols other than '&' */
+int lcode_is_bindings(lval* v) {
+  if (v->count % 2) { return 0; }
+  for (int i = 0; i < v->count; i += 2) {
+    if (LTYPE(v->cell[i]) != LVAL_SYM) { return 0; }
+    if (v->cell[i]->sym == lsym_amp) { return 0; }
+    for (int j = 0; j < i; j += 2) {
+      if (v->cell[j]->sym == v->cell[i]->sym) { return 0; }
+    }
+  }
+  return 1;
+}
+
+/* (loop {var init ...} {body}) compiled as a lambda over the loop */
+/* variables which is called once. A 'recur' in tail position of   */
+/* its body assigns their slots and restarts it                    */
+void lcode_compile_loop(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_LOOP);
+
+  lval* vars = v->cell[1];
+  lval* formals = lval_qexpr();
+  for (int i = 0; i < vars->count; i += 2) {
+    formals = lval_add(formals, lval_copy(vars->cell[i]));
+  }
+  lval* f = lval_lambda(formals, lval_copy(v->cell[2]), c);
+  f->code->loop = formals->count;
+  lcode_emit(c, OP_CLOSURE);
+  lcode_emit(c, lcode_const(c, f));
+  lval_del(f);
+
+  for (int i = 1; i < vars->count; i += 2) {
+    lcode_compile_expr(c, vars->cell[i], 0);
+  }
+  lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+  lcode_emit(c, vars->count / 2);
+  lcode_emit(c, OP_JUMP);
+  int end = lcode_emit(c, -1);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch(c, end);
+}
+
+/* Check if v looks like a call to sym with {test expr} clauses as */
+/* its arguments from i on                                         */
+int lcode_is_clauses(lval* v, lsym* sym, int i) {
+  if (v->count < i) { return 0; }
+  if (LTYPE(v->cell[0]) != LVAL_SYM) { return 0; }
+  if (v->cell[0]->sym != sym) { return 0; }
+  for (; i < v->count; i++) {
+    if (LTYPE(v->cell[i]) != LVAL_QEXPR) { return 0; }
+    if (v->cell[i]->count != 2) { return 0; }
+  }
+  return 1;
+}
+
+/* (select {test expr} ...) with each test evaluated in place until */
+/* one holds, and its expression evaluated after it                 */
+void lcode_compile_select(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_SELECT);
+
+  int end = -1;
+  for (int i = 1; i < v->count; i++) {
+    lval* clause = v->cell[i];
+    lcode_compile_expr(c, clause->cell[0], 0);
+    int next = lcode_test(c, LFORM_SELECT, i - 1);
+    c->ops[next + 1] = end;
+    end = next + 1;
+
+    lcode_compile_expr(c, clause->cell[1], tail);
+    lcode_emit(c, OP_JUMP);
+    end = lcode_chain(c, end);
+    lcode_patch(c, next);
+  }
+  lcode_err(c, "No selection found");
+  lcode_emit(c, OP_JUMP);
+  end = lcode_chain(c, end);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch_chain(c, end);
+}
+
+/* (case x {key expr} ...) with each key evaluated in place until one */
+/* equals x, and its expression evaluated after it                    */
+void lcode_compile_case(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_CASE);
+
+  lcode_compile_expr(c, v->cell[1], 0);
+  int end = -1;
+  for (int i = 2; i < v->count; i++) {
+    lval* clause = v->cell[i];
+    lcode_compile_expr(c, clause->cell[0], 0);
+    lcode_emit(c, OP_MATCH);
+    int next = lcode_emit(c, -1);
+    end = lcode_chain(c, end);
+
+    lcode_compile_expr(c, clause->cell[1], tail);
+    lcode_emit(c, OP_JUMP);
+    end = lcode_chain(c, end);
+    lcode_patch(c, next);
+  }
+
+  /* No key matched, so x is dropped unless it is an error */
+  lcode_emit(c, OP_POP);
+  end = lcode_chain(c, end);
+  lcode_err(c, "No case found");
+  lcode_emit(c, OP_JUMP);
+  end = lcode_chain(c, end);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch_chain(c, end);
+}
+
+/* (let {body}) compiled as a lambda without formals which is called */
+/* once, so that '=' in its body defines in a scope of its own       */
+void lcode_compile_let(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_LET);
+
+  lval* f = lval_lambda(lval_qexpr(), lval_copy(v->cell[1]), c);
+  lcode_emit(c, OP_CLOSURE);
+  lcode_emit(c, lcode_const(c, f));
+  lval_del(f);
+  lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+  lcode_emit(c, 0);
+  lcode_emit(c, OP_JUMP);
+  int end = lcode_emit(c, -1);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch(c, end);
+}
+
+/* (do x ...) with each expression evaluated in turn and all but the */
+/* last dropped, so that the last is in tail position                 */
+void lcode_compile_do(lcode* c, lval* v, int tail) {
+  int generic = lcode_guard(c, v->cell[0], LFORM_DO);
+
+  int end = -1;
+  for (int i = 1; i < v->count - 1; i++) {
+    lcode_compile_expr(c, v->cell[i], 0);
+    lcode_emit(c, OP_POP);
+    end = lcode_chain(c, end);
+  }
+  lcode_compile_expr(c, v->cell[v->count - 1], tail);
+  lcode_emit(c, OP_JUMP);
+  end = lcode_chain(c, end);
+
+  lcode_patch(c, generic);
+  lcode_compile_call(c, v, tail);
+  lcode_patch_chain(c, end);
+}
+
+/* Compile the cells of v as an S-Expression, whatever its type */
+void lcode_compile_sexpr(lcode* c, lval* v, int tail) {
+
+  /* Empty expression evaluates to itself */
+  if (v->count == 0) {
+    lval* x = lval_sexpr();
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, x));
+    lval_del(x);
+    return;
+  }
+
+  /* Single expression evaluates to its only element, which in */
+  /* parentheses is called if it is a builtin                   */
+  if (v->count == 1) {
+    lcode_compile_expr(c, v->cell[0], tail && LTYPE(v) != LVAL_SEXPR);
+    if (LTYPE(v) == LVAL_SEXPR) { lcode_emit(c, OP_CALL0); }
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_if, 4, 2)) {
+    lcode_compile_if(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_eval, 2, 1)) {
+    lcode_compile_eval(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_lambda, 3, 1) && lcode_is_formals(v->cell[1])) {
+    lcode_compile_lambda(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_and, 3, 3)) {
+    lcode_compile_logic(c, v, LFORM_AND, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_or, 3, 3)) {
+    lcode_compile_logic(c, v, LFORM_OR, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_while, 3, 1)) {
+    lcode_compile_while(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_loop, 3, 1) && lcode_is_bindings(v->cell[1])) {
+    lcode_compile_loop(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_clauses(v, lsym_select, 1)) {
+    lcode_compile_select(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_clauses(v, lsym_case, 2)) {
+    lcode_compile_case(c, v, tail);
+    return;
+  }
+
+  if (lcode_is_form(v, lsym_let, 2, 1)) {
+    lcode_compile_let(c, v, tail);
+    return;
+  }
+
+  if (LTYPE(v->cell[0]) == LVAL_SYM && v->cell[0]->sym == lsym_do) {
+    lcode_compile_do(c, v, tail);
+    return;
+  }
+
+  lcode_compile_call(c, v, tail);
+}
+
+void lcode_compile_expr(lcode* c, lval* x, int tail) {
+  switch (LTYPE(x)) {
+  case LVAL_SYM:
+    lcode_compile_sym(c, x);
+    break;
+  case LVAL_SEXPR:
+    lcode_compile_sexpr(c, x, tail);
+    break;
+    /* All other lval types evaluate to themselves */
+  default:
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, x));
+    break;
+  }
+}
+
+/* Compile a lambda body, which is evaluated as an S-Expression */
+lcode* lcode_compile(lval* formals, lval* body, lcode* outer) {
+  lcode* c = lcode_new();
+  c->formals = formals;
+  c->outer = outer;
+  lcode_compile_sexpr(c, body, 1);
+  lcode_emit(c, OP_RETURN);
+
+  /* Neither is kept alive by the code */
+  c->formals = NULL;
+  c->outer = NULL;
+  return c;
+}
+
+
+/* --- virtual machine --- */
+
+/* Value stack shared by all active calls to lvm_run */
+lval** lvm_stack = NULL;
+int lvm_sp = 0;
+int lvm_cap = 0;
+
+/* Frames of callers suspended while a lambda they called runs */
+lframe* lvm_frames = NULL;
+int lvm_fp = 0;
+int lvm_fcap = 0;
+
+void lvm_push(lval* x) {
+  if (lvm_sp == lvm_cap) {
+    lvm_cap = lvm_cap ? lvm_cap * 2 : 256;
+    lvm_stack = realloc(lvm_stack, sizeof(lval*) * lvm_cap);
+  }
+  lvm_stack[lvm_sp++] = x;
+}
+
+#ifdef LISPY_GC
+/* Make the current frame visible to the collector while C code runs */
+#define LVM_SAVE() lvm_push_frame(c, pc, e, fun)
+#define LVM_RESTORE() (lvm_fp--)
+#else
+#define LVM_SAVE()
+#define LVM_RESTORE()
+#endif
+
+void lvm_push_frame(lcode* c, int pc, lenv* e, lval* fun) {
+  if (lvm_fp == lvm_fcap) {
+    lvm_fcap = lvm_fcap ? lvm_fcap * 2 : 64;
+    lvm_frames = realloc(lvm_frames, sizeof(lframe) * lvm_fcap);
+  }
+  lframe* fr = &lvm_frames[lvm_fp++];
+  fr->code = c;
+  fr->pc = pc;
+  fr->env = e;
+  fr->fun = fun;
+}
+
+/* Pop and delete the top n values */
+void lvm_drop(int n) {
+  while (n--) { lval_del(lvm_stack[--lvm_sp]); }
+}
+
+/* Check the function below n arguments on top of the stack can be  */
+/* called. Returns NULL if so, otherwise pops them all and returns  */
+/* the first error among them or an error for the function's type   */
+lval* lvm_check_call(int n) {
+  lval** v = &lvm_stack[lvm_sp - n - 1];
+
+  /* Error checking, the first error found is the result */
+  for (int i = 0; i <= n; i++) {
+    if (LTYPE(v[i]) == LVAL_ERR) {
+      lval* err = lval_copy(v[i]);
+      lvm_drop(n + 1);
+      return err;
+    }
+  }
+
+  /* Ensure first element is a Function */
+  if (LTYPE(v[0]) != LVAL_FUN) {
+    lval* err = lval_err("S-Expression start with incorrect type. "
+                         "Got %s, Expected: %s.",
+                         ltype_name(LTYPE(v[0])),
+                         ltype_name(LVAL_FUN));
+    lvm_drop(n + 1);
+    return err;
+  }
+
+  return NULL;
+}
+
+/* Call the function below n arguments on top of the stack, which   */
+/* lvm_check_call accepted, popping them all and returning the result */
+lval* lvm_call(lenv* e, int n) {
+  int base = lvm_sp - n - 1;
+  lval* x = lval_call(e, lvm_stack[base], n, &lvm_stack[base + 1]);
+  lvm_drop(n + 1);
+  return x;
+}
+
+/* Builtins which end by evaluating code picked from their arguments, */
+/* and the functions which pick it                                    */
+lprim lvm_pickers[][2] = {
+  { builtin_if,     builtin_if_expr },
+  { builtin_eval,   builtin_eval_expr },
+  { builtin_select, builtin_select_expr },
+  { builtin_case,   builtin_case_expr },
+};
+
+lprim lvm_pick(lprim f) {
+  int n = sizeof(lvm_pickers) / sizeof(lvm_pickers[0]);
+  for (int i = 0; i < n; i++) {
+    if (lvm_pickers[i][0] == f) { return lvm_pickers[i][1]; }
+  }
+  return NULL;
+}
+
+/* Run lambda f in environment e, taking ownership of both */
+lval* lvm_run(lval* f, lenv* e) {
+  /* Frames below base belong to whoever called us */
+  int base = lvm_fp;
+
+  /* Lambda being run, which keeps its code alive */
+  lval* fun = f;
+
+  lcode* c = f->code;
+  int* ops = c->ops;
+  int pc = 0;
+
+  while (1) {
+    switch (ops[pc++]) {
+
+    case OP_CONST:
+      lvm_push(lval_copy(c->consts[ops[pc++]]));
+      break;
+
+    case OP_LOAD: {
+      lval* k = c->consts[ops[pc]];
+      lval* x = lenv_search(e, k->sym, &ops[pc + 1]);
+      lvm_push(x ? lval_copy(x) : lval_err("Unboud symbol '%s'", k->sym->name));
+      pc += 2;
+    } break;
+
+    case OP_LOCAL: {
+      /* Walk out to the frame of the lambda the formal belongs to, */
+      /* unless one on the way may shadow it                        */
+      lenv* f = e;
+      int d = ops[pc];
+      while (d && !f->extended) { f = f->par; d--; }
+      lval* x = d ? lenv_search_frames(e, c->consts[ops[pc + 2]]->sym)
+                  : f->vals[ops[pc + 1]];
+      lvm_push(lval_copy(x));
+      pc += 3;
+    } break;
+
+    case OP_CLOSURE: {
+      lval* t = c->consts[ops[pc++]];
+      lval* x = lval_alloc(LVAL_FUN);
+      x->prim = NULL;
+      x->builtin = NULL;
+      x->env = lenv_new();
+      x->env->par = lenv_ref(e);
+      x->formals = lval_copy(t->formals);
+      x->body = lval_copy(t->body);
+      x->code = t->code;
+      x->code->refs++;
+      lvm_push(x);
+    } break;
+
+    case OP_CALL:
+    case OP_TAILCALL: {
+      int tail = (ops[pc - 1] == OP_TAILCALL);
+      int n = ops[pc++];
+      int recur = 0;
+      lval* x = lvm_check_call(n);
+
+      /* Builtins are called on their arguments where they lie */
+      while (!x && LBUILTIN_P(lvm_stack[lvm_sp - n - 1])) {
+        lval* f = lvm_stack[lvm_sp - n - 1];
+
+        /* 'recur' in tail position of a loop body moves its arguments */
+        /* into the slots of the loop's variables and starts it again */
+        if (tail && c->loop >= 0 && f->prim == builtin_recur) {
+          if (n != c->loop) {
+            lvm_drop(n + 1);
+            x = lval_err("Function '%s' passed incorrect number of arguments. "
+                         "Got %i, Expected %i.", "recur", n, c->loop);
+            break;
+          }
+          for (int i = n - 1; i >= 0; i--) {
+            lloop_set(e, i, lvm_stack[--lvm_sp]);
+          }
+          lval_del(lvm_stack[--lvm_sp]);
+          recur = 1;
+          break;
+        }
+
+        /* In tail position evaluate the code a builtin such as 'if' */
+        /* picks here, so that any call it makes is a tail call     */
+        lprim pick = tail ? lvm_pick(f->prim) : NULL;
+        if (pick) {
+          LVM_SAVE();
+          lval* q = pick(e, n, &lvm_stack[lvm_sp - n]);
+          LVM_RESTORE();
+          lvm_drop(n + 1);
+          if (LTYPE(q) == LVAL_ERR) { x = q; break; }
+
+          /* Keep this frame for calls which may need its variables */
+          if (lval_quotes(q)) { tail = 0; }
+          LVM_SAVE();
+          x = lval_eval_args(e, q, &n);
+          LVM_RESTORE();
+          lval_del(q);
+          continue;
+        }
+
+        LVM_SAVE();
+        x = lvm_call(e, n);
+        LVM_RESTORE();
+      }
+
+      if (recur) {
+        pc = 0;
+#ifdef LISPY_GC
+        LVM_SAVE();
+        lgc_safepoint();
+        LVM_RESTORE();
+#endif
+        break;
+      }
+
+      /* Lambdas which are fully applied are entered below */
+      lval* f = NULL;
+      lenv* env = NULL;
+      if (!x) {
+        f = lval_copy(lvm_stack[lvm_sp - n - 1]);
+        x = lval_bind(e, f, n, &lvm_stack[lvm_sp - n], &env);
+        lvm_drop(n + 1);
+        if (x) {
+          lval_del(f);
+          f = NULL;
+        }
+      }
+
+      if (!f) {
+        lvm_push(x);
+        break;
+      }
+
+      if (tail) {
+        /* Nothing passed on can refer to the current frame, so replace it */
+        env->dyn = e->dyn;
+        lenv_leave(e);
+        lval_del(fun);
+      } else {
+        lvm_push_frame(c, pc, e, fun);
+      }
+
+      fun = f;
+      e = env;
+      c = f->code;
+      ops = c->ops;
+      pc = 0;
+
+#ifdef LISPY_GC
+      /* Entering a lambda is a safe point to collect garbage */
+      LVM_SAVE();
+      lgc_safepoint();
+      LVM_RESTORE();
+#endif
+    } break;
+
+    case OP_CALL0: {
+      if (LTYPE(lvm_stack[lvm_sp - 1]) != LVAL_FUN
+          || !LBUILTIN_P(lvm_stack[lvm_sp - 1])) { break; }
+      LVM_SAVE();
+      lval* x = lvm_call(e, 0);
+      LVM_RESTORE();
+      lvm_push(x);
+    } break;
+
+    case OP_GUARD: {
+      /* Take the inlined path only if symbol still names the builtin */
+      lval* f = lenv_search(e, c->consts[ops[pc]]->sym, &ops[pc + 3]);
+      if (f && LTYPE(f) == LVAL_FUN && f->prim == lforms[ops[pc + 1]]) {
+        pc += 4;
+      } else {
+        pc = ops[pc + 2];
+      }
+    } break;
+
+    case OP_TEST: {
+      lval* x = lvm_stack[lvm_sp - 1];
+
+      /* Errors are left on the stack as the result of the form */
+      if (LTYPE(x) != LVAL_NUM) {
+        if (LTYPE(x) != LVAL_ERR) {
+          lvm_stack[lvm_sp - 1] =
+            lval_err("Function '%s' passed incorrect type for argument %i. "
+                     "Got %s, Expected %s.",
+                     lform_name[ops[pc + 2]], ops[pc + 3],
+                     ltype_name(LTYPE(x)), ltype_name(LVAL_NUM));
+          lval_del(x);
+        }
+        pc = ops[pc + 1];
+        break;
+      }
+
+      lvm_sp--;
+      pc = LNUM(x) ? pc + 4 : ops[pc];
+      lval_del(x);
+    } break;
+
+    case OP_MATCH: {
+      lval* k = lvm_stack[lvm_sp - 1];
+      lval* x = lvm_stack[lvm_sp - 2];
+
+      /* Errors in either are left on the stack as the result */
+      if (LTYPE(x) == LVAL_ERR || LTYPE(k) == LVAL_ERR) {
+        lvm_sp -= 2;
+        lval_del(LTYPE(x) == LVAL_ERR ? k : x);
+        lvm_push(LTYPE(x) == LVAL_ERR ? x : k);
+        pc = ops[pc + 1];
+        break;
+      }
+
+      /* Both are popped once a key matches, so its code runs next */
+      int match = lval_eq(x, k);
+      lvm_drop(match ? 2 : 1);
+      pc = match ? pc + 2 : ops[pc];
+    } break;
+
+    case OP_POP: {
+      lval* x = lvm_stack[lvm_sp - 1];
+      if (LTYPE(x) == LVAL_ERR) {
+        pc = ops[pc];
+        break;
+      }
+      lvm_sp--;
+      lval_del(x);
+      pc++;
+    } break;
+
+    case OP_JUMP:
+#ifdef LISPY_GC
+      /* Jumping back to run a loop again is a safe point */
+      if (ops[pc] < pc) {
+        pc = ops[pc];
+        LVM_SAVE();
+        lgc_safepoint();
+        LVM_RESTORE();
+        break;
+      }
+#endif
+      pc = ops[pc];
+      break;
+
+    case OP_RETURN: {
+      /* Result is left on the stack for the caller */
+      lenv_leave(e);
+      lval_del(fun);
+      if (lvm_fp == base) { return lvm_stack[--lvm_sp]; }
+
+      lframe* fr = &lvm_frames[--lvm_fp];
+      c = fr->code;
+      pc = fr->pc;
+      e = fr->env;
+      fun = fr->fun;
+      ops = c->ops;
+    } break;
+    }
+  }
+}
+
+
+#ifdef LISPY_GC
+
+/* --- garbage collector --- */
+
+#define LGC_MIN_THRESHOLD 100000
+
+/* Every lval and lenv allocated, linked through their next fields */
+lval* lgc_vals = NULL;
+lenv* lgc_envs = NULL;
+
+/* Global environment, the root of everything defined with def */
+lenv* lgc_global = NULL;
+
+/* Values held only by C code which may run a collection */
+lval** lgc_roots = NULL;
+int lgc_nroots = 0;
+int lgc_rcap = 0;
+
+/* Environments held only by C code, such as the scope of a 'let' */
+lenv** lgc_envroots = NULL;
+int lgc_nenvroots = 0;
+int lgc_ercap = 0;
+
+/* Values found to be reachable but not yet scanned */
+lval** lgc_gray = NULL;
+int lgc_ngray = 0;
+int lgc_gcap = 0;
+
+/* Collect once this many objects were allocated since the last time */
+long lgc_allocs = 0;
+long lgc_min_threshold = LGC_MIN_THRESHOLD;
+long lgc_threshold = LGC_MIN_THRESHOLD;
+
+/* Statistics reported with LISPY_GC_VERBOSE */
+int lgc_verbose = 0;
+long lgc_collections = 0;
+double lgc_pause_total = 0;
+double lgc_pause_max = 0;
+size_t lgc_reclaimed_total = 0;
+
+void lgc_track_val(lval* v) {
+  v->mark = 0;
+  v->next = lgc_vals;
+  lgc_vals = v;
+  lgc_allocs++;
+}
+
+void lgc_track_env(lenv* e) {
+  e->mark = 0;
+  e->next = lgc_envs;
+  lgc_envs = e;
+  lgc_allocs++;
+}
+
+void lgc_protect(lval* v) {
+  if (lgc_nroots == lgc_rcap) {
+    lgc_rcap = lgc_rcap ? lgc_rcap * 2 : 64;
+    lgc_roots = realloc(lgc_roots, sizeof(lval*) * lgc_rcap);
+  }
+  lgc_roots[lgc_nroots++] = v;
+}
+
+void lgc_protect_env(lenv* e) {
+  if (lgc_nenvroots == lgc_ercap) {
+    lgc_ercap = lgc_ercap ? lgc_ercap * 2 : 16;
+    lgc_envroots = realloc(lgc_envroots, sizeof(lenv*) * lgc_ercap);
+  }
+  lgc_envroots[lgc_nenvroots++] = e;
+}
+
+void lgc_mark_val(lval* v) {
+  if (LFIX_P(v) || v->mark) { return; }
+  v->mark = 1;
+  if (lgc_ngray == lgc_gcap) {
+    lgc_gcap = lgc_gcap ? lgc_gcap * 2 : 256;
+    lgc_gray = realloc(lgc_gray, sizeof(lval*) * lgc_gcap);
+  }
+  lgc_gray[lgc_ngray++] = v;
+}
+
+void lgc_mark_env(lenv* e) {
+  /* Parents are followed in a loop as call chains can be long */
+  while (e && !e->mark) {
+    e->mark = 1;
+    for (int i = 0; i < e->count; i++) { lgc_mark_val(e->vals[i]); }
+    e = e->par;
+  }
+}
+
+/* Mark everything v refers to */
+void lgc_scan(lval* v) {
+  switch (v->type) {
+  case LVAL_FUN:
+    if (!LBUILTIN_P(v)) {
+      lgc_mark_env(v->env);
+      lgc_mark_val(v->formals);
+      lgc_mark_val(v->body);
+      for (int i = 0; i < v->code->nconsts; i++) {
+        lgc_mark_val(v->code->consts[i]);
+      }
+    }
+    if (LMEMO_P(v)) {
+      lgc_mark_val(v->body);
+      for (lmemo_entry* m = v->memo->newest; m; m = m->older) {
+        for (int i = 0; i < m->argc; i++) { lgc_mark_val(m->argv[i]); }
+        lgc_mark_val(m->result);
+      }
+    }
+    break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+    for (int i = 0; i < v->count; i++) { lgc_mark_val(v->cell[i]); }
+    break;
+  case LVAL_MAP:
+    for (int i = 0; i < v->map->count; i++) {
+      lgc_mark_val(v->map->keys[i]);
+      if (v->map->vals[i]) { lgc_mark_val(v->map->vals[i]); }
+    }
+    if (v->map->newer) { lgc_mark_val(v->map->newer); }
+    break;
+  default: break;
+  }
+}
+
+/* Approximate number of bytes held by v and e themselves */
+size_t lval_bytes(lval* v) {
+  size_t n = sizeof(lval);
+  switch (v->type) {
+  case LVAL_ERR: n += strlen(v->err) + 1; break;
+  case LVAL_STR: n += strlen(v->str) + 1; break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR: n += sizeof(lval*) * v->count; break;
+  case LVAL_MAP:
+    n += sizeof(lmap) + (sizeof(lval*) * 2 + sizeof(unsigned long))
+      * v->map->cap + sizeof(int) * v->map->size;
+    break;
+  case LVAL_VEC: n += sizeof(long) * v->count; break;
+  case LVAL_BIG: n += sizeof(uint32_t) * abs(v->count); break;
+  default: break;
+  }
+  return n;
+}
+
+size_t lenv_bytes(lenv* e) {
+  return sizeof(lenv) + (sizeof(lsym*) + sizeof(lval*)) * e->cap
+    + sizeof(int) * e->size;
+}
+
+void lgc_collect(void) {
+  clock_t start = clock();
+
+  /* Mark from the global environment, evaluator stacks and C roots */
+  if (lgc_global) { lgc_mark_env(lgc_global); }
+  for (int i = 0; i < lvm_sp; i++) { lgc_mark_val(lvm_stack[i]); }
+  for (int i = 0; i < lvm_fp; i++) {
+    lgc_mark_env(lvm_frames[i].env);
+    lgc_mark_val(lvm_frames[i].fun);
+  }
+  for (int i = 0; i < lgc_nroots; i++) { lgc_mark_val(lgc_roots[i]); }
+  for (int i = 0; i < lgc_nenvroots; i++) { lgc_mark_env(lgc_envroots[i]); }
+
+  while (lgc_ngray) { lgc_scan(lgc_gray[--lgc_ngray]); }
+
+  /* Sweep, freeing what was not marked and unmarking the rest */
+  size_t reclaimed = 0;
+  size_t live = 0;
+  long objects = 0;
+
+  lval** vp = &lgc_vals;
+  while (*vp) {
+    lval* v = *vp;
+    if (v->mark) {
+      v->mark = 0;
+      live += lval_bytes(v);
+      objects++;
+      vp = &v->next;
+    } else {
+      *vp = v->next;
+      reclaimed += lval_bytes(v);
+      lval_free(v);
+    }
+  }
+
+  lenv** ep = &lgc_envs;
+  while (*ep) {
+    lenv* e = *ep;
+    if (e->mark) {
+      e->mark = 0;
+      live += lenv_bytes(e);
+      objects++;
+      ep = &e->next;
+    } else {
+      *ep = e->next;
+      reclaimed += lenv_bytes(e);
+      lenv_free(e);
+    }
+  }
+
+  /* Let the heap grow to twice what survived before collecting again */
+  lgc_allocs = 0;
+  lgc_threshold = objects * 2;
+  if (lgc_threshold < lgc_min_threshold) { lgc_threshold = lgc_min_threshold; }
+
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC * 1000.0;
+  lgc_collections++;
+  lgc_pause_total += pause;
+  if (pause > lgc_pause_max) { lgc_pause_max = pause; }
+  lgc_reclaimed_total += reclaimed;
+
+  if (lgc_verbose) {
+    fprintf(stderr, "gc: collection %li paused %.3f ms, reclaimed %zu bytes,"
+            " %zu bytes live in %li objects\n",
+            lgc_collections, pause, reclaimed, live, objects);
+  }
+}
+
+void lgc_safepoint(void) {
+  if (lgc_allocs >= lgc_threshold) { lgc_collect(); }
+}
+
+void lgc_init(lenv* e) {
+  lgc_global = e;
+  lgc_verbose = getenv("LISPY_GC_VERBOSE") != NULL;
+  char* threshold = getenv("LISPY_GC_THRESHOLD");
+  if (threshold) {
+    lgc_min_threshold = strtol(threshold, NULL, 10);
+    lgc_threshold = lgc_min_threshold;
+  }
+}
+
+/* Free everything and report totals */
+void lgc_shutdown(void) {
+  lgc_global = NULL;
+  lgc_collect();
+  if (lgc_verbose) {
+    fprintf(stderr, "gc: %li collections, %.3f ms total pause,"
+            " %.3f ms longest, %zu bytes reclaimed\n",
+            lgc_collections, lgc_pause_total, lgc_pause_max,
+            lgc_reclaimed_total);
+  }
+}
+
+#endif
+
+
+/* --- builtin functions --- */
+
+lval* builtin_head(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("head", argc, 1);
+  LCHECK_TYPE("head", argv, 0, LVAL_QEXPR);
+  LCHECK_NOT_EMPTY("head", argv, 0);
+
+  return lval_add(lval_qexpr(), lval_copy(argv[0]->cell[0]));
+}
+
+lval* builtin_tail(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("tail", argc, 1);
+  LCHECK_TYPE("tail", argv, 0, LVAL_QEXPR);
+  LCHECK_NOT_EMPTY("tail", argv, 0);
+
+  return lval_list(argv[0]->count - 1, &argv[0]->cell[1]);
+}
+
+lval* builtin_list(lenv* e, int argc, lval** argv) {
+  return lval_list(argc, argv);
+}
+
+lval* builtin_eval(lenv* e, int argc, lval** argv) {
+  lval* x = builtin_eval_expr(e, argc, argv);
+  if (LTYPE(x) == LVAL_ERR) { return x; }
+  lval* r = lval_eval_list(e, x);
+  lval_del(x);
+  return r;
+}
+
+/* Check arguments to 'eval' and return the Q-Expression whose cells */
+/* are evaluated                                                     */
+lval* builtin_eval_expr(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("eval", argc, 1);
+  LCHECK_TYPE("eval", argv, 0, LVAL_QEXPR);
+  return lval_copy(argv[0]);
+}
+
+lval* builtin_join(lenv* e, int argc, lval** argv) {
+  for (int i = 0; i < argc; i++) {
+    LCHECK_TYPE("join", argv, i, LVAL_QEXPR);
+  }
+  if (argc == 0) { return lval_qexpr(); }
+
+  lval* x = lval_copy(argv[0]);
+  for (int i = 1; i < argc; i++) {
+    x = lval_join(x, lval_copy(argv[i]));
+  }
+  return x;
+}
+
+lval* builtin_len(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("len", argc, 1);
+  LCHECK_TYPE("len", argv, 0, LVAL_QEXPR);
+  return lval_num(argv[0]->count);
+}
+
+lval* builtin_nth(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("nth", argc, 2);
+  LCHECK_TYPE("nth", argv, 0, LVAL_NUM);
+  LCHECK_TYPE("nth", argv, 1, LVAL_QEXPR);
+
+  long n = LNUM(argv[0]);
+  LCHECK(n >= 0 && n < argv[1]->count,
+         "Function 'nth' passed index %li out of range for list of %i.",
+         n, argv[1]->count);
+  return lval_copy(argv[1]->cell[n]);
+}
+
+lval* builtin_last(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("last", argc, 1);
+  LCHECK_TYPE("last", argv, 0, LVAL_QEXPR);
+  LCHECK_NOT_EMPTY("last", argv, 0);
+  return lval_copy(argv[0]->cell[argv[0]->count - 1]);
+}
+
+/* Check arguments are a count and a list, giving the count clamped to */
+/* the length of the list in n                                         */
+lval* builtin_count_list(char* func, int argc, lval** argv, int* n) {
+  LCHECK_NUM_ARGS(func, argc, 2);
+  LCHECK_TYPE(func, argv, 0, LVAL_NUM);
+  LCHECK_TYPE(func, argv, 1, LVAL_QEXPR);
+
+  long x = LNUM(argv[0]);
+  *n = x < 0 ? 0 : x > argv[1]->count ? argv[1]->count : (int)x;
+  return NULL;
+}
+
+lval* builtin_take(lenv* e, int argc, lval** argv) {
+  int n;
+  lval* err = builtin_count_list("take", argc, argv, &n);
+  if (err) { return err; }
+  return lval_list(n, argv[1]->cell);
+}
+
+lval* builtin_drop(lenv* e, int argc, lval** argv) {
+  int n;
+  lval* err = builtin_count_list("drop", argc, argv, &n);
+  if (err) { return err; }
+  return lval_list(argv[1]->count - n, &argv[1]->cell[n]);
+}
+
+lval* builtin_split(lenv* e, int argc, lval** argv) {
+  int n;
+  lval* err = builtin_count_list("split", argc, argv, &n);
+  if (err) { return err; }
+
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_list(n, argv[1]->cell));
+  x = lval_add(x, lval_list(argv[1]->count - n, &argv[1]->cell[n]));
+  return x;
+}
+
+lval* builtin_elem(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("elem", argc, 2);
+  LCHECK_TYPE("elem", argv, 1, LVAL_QEXPR);
+
+  for (int i = 0; i < argv[1]->count; i++) {
+    if (lval_eq(argv[0], argv[1]->cell[i])) { return lval_num(1); }
+  }
+  return lval_num(0);
+}
+
+/* Functions called below may move the value stack argv is on, so the */
+/* function and list are read from it first. Both stay on the stack, */
+/* which keeps them alive, and the list cannot change while shared   */
+
+lval* builtin_map(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("map", argc, 2);
+  LCHECK_TYPE("map", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("map", argv, 1, LVAL_QEXPR);
+
+  lval* f = argv[0];
+  lval* l = argv[1];
+
+  /* Results are filled in over placeholder fixnums */
+  lval* x = lval_qexpr();
+  x->count = l->count;
+  x->cell = lcells_alloc(l->count);
+  for (int i = 0; i < l->count; i++) { x->cell[i] = lval_num(0); }
+
+  LGC_PROTECT(x);
+  for (int i = 0; i < l->count; i++) {
+    lval* r = lval_call(e, f, 1, &l->cell[i]);
+    if (LTYPE(r) == LVAL_ERR) {
+      lval_del(x);
+      x = r;
+      break;
+    }
+    x->cell[i] = r;
+  }
+  LGC_UNPROTECT(1);
+  return x;
+}
+
+lval* builtin_filter(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("filter", argc, 2);
+  LCHECK_TYPE("filter", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("filter", argv, 1, LVAL_QEXPR);
+
+  lval* f = argv[0];
+  lval* l = argv[1];
+
+  lval* x = lval_qexpr();
+  LGC_PROTECT(x);
+  for (int i = 0; i < l->count; i++) {
+    lval* r = lval_call(e, f, 1, &l->cell[i]);
+    if (LTYPE(r) != LVAL_NUM) {
+      lval_del(x);
+      if (LTYPE(r) == LVAL_ERR) {
+        x = r;
+        break;
+      }
+      x = lval_err("Function 'filter' passed function returning %s, "
+                   "Expected %s.", ltype_name(LTYPE(r)), ltype_name(LVAL_NUM));
+      lval_del(r);
+      break;
+    }
+    if (LNUM(r)) { x = lval_add(x, lval_copy(l->cell[i])); }
+    lval_del(r);
+  }
+  LGC_UNPROTECT(1);
+  return x;
+}
+
+lval* builtin_foldl(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("foldl", argc, 3);
+  LCHECK_TYPE("foldl", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("foldl", argv, 2, LVAL_QEXPR);
+
+  lval* f = argv[0];
+  lval* l = argv[2];
+  lval* z = lval_copy(argv[1]);
+
+  for (int i = 0; i < l->count && LTYPE(z) != LVAL_ERR; i++) {
+    lval* args[2] = { z, l->cell[i] };
+    LGC_PROTECT(z);
+    lval* r = lval_call(e, f, 2, args);
+    LGC_UNPROTECT(1);
+    lval_del(z);
+    z = r;
+  }
+  return z;
+}
+
+lval* builtin_sum(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("sum", argc, 1);
+  LCHECK_TYPE("sum", argv, 0, LVAL_QEXPR);
+  if (argv[0]->count == 0) { return lval_num(0); }
+  return builtin_op(e, argv[0]->count, argv[0]->cell, LOPR_ADD);
+}
+
+lval* builtin_product(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("product", argc, 1);
+  LCHECK_TYPE("product", argv, 0, LVAL_QEXPR);
+  if (argv[0]->count == 0) { return lval_num(1); }
+  return builtin_op(e, argv[0]->count, argv[0]->cell, LOPR_MUL);
+}
+
+/* Add the keys and values alternating in argv from i on to map x, */
+/* noting how to undo the changes in undo if given                 */
+lval* builtin_map_pairs(char* func, lval* x, lmap* undo,
+                        int argc, lval** argv, int i) {
+  for (int j = i; j < argc; j += 2) {
+    if (j + 1 == argc) {
+      lval_del(x);
+      return lval_err("Function '%s' passed key %i without a value.",
+                      func, j);
+    }
+    if (!LINT_P(argv[j]) && LTYPE(argv[j]) != LVAL_STR
+        && LTYPE(argv[j]) != LVAL_SYM) {
+      lval_del(x);
+      return lval_err("Function '%s' passed incorrect type for argument %i. "
+                      "Got %s, Expected Number, String or Symbol.",
+                      func, j, ltype_name(LTYPE(argv[j])));
+    }
+    lmap_set(x->map, undo, argv[j], argv[j + 1]);
+  }
+  return x;
+}
+
+/* (map-new key value ...) */
+lval* builtin_map_new(lenv* e, int argc, lval** argv) {
+  return builtin_map_pairs("map-new", lval_map(), NULL, argc, argv, 0);
+}
+
+/* (map-get m key) or (map-get m key default) */
+lval* builtin_map_get(lenv* e, int argc, lval** argv) {
+  LCHECK(argc == 2 || argc == 3,
+         "Function 'map-get' passed incorrect number of arguments. "
+         "Got %i, Expected %i or %i.", argc, 2, 3);
+  LCHECK_TYPE("map-get", argv, 0, LVAL_MAP);
+  LCHECK_KEY("map-get", argv, 1);
+
+  lmap* m = lmap_of(argv[0]);
+  int i = lmap_find(m, argv[1], lval_hash(argv[1]));
+  if (i >= 0) { return lval_copy(m->vals[i]); }
+  if (argc == 3) { return lval_copy(argv[2]); }
+  return lval_err("Key not found in map.");
+}
+
+lval* builtin_map_has(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("map-has", argc, 2);
+  LCHECK_TYPE("map-has", argv, 0, LVAL_MAP);
+  LCHECK_KEY("map-has", argv, 1);
+  lmap* m = lmap_of(argv[0]);
+  return lval_num(lmap_find(m, argv[1], lval_hash(argv[1])) >= 0);
+}
+
+/* (map-put m key value ...) giving m with the entries added */
+lval* builtin_map_put(lenv* e, int argc, lval** argv) {
+  LCHECK(argc >= 1,
+         "Function 'map-put' passed incorrect number of arguments. "
+         "Got %i, Expected at least %i.", argc, 1);
+  LCHECK_TYPE("map-put", argv, 0, LVAL_MAP);
+  lmap* undo;
+  lval* x = lval_map_edit(argv[0], &undo);
+  return builtin_map_pairs("map-put", x, undo, argc, argv, 1);
+}
+
+/* (map-del m key ...) giving m without the entries for the keys */
+lval* builtin_map_del(lenv* e, int argc, lval** argv) {
+  LCHECK(argc >= 1,
+         "Function 'map-del' passed incorrect number of arguments. "
+         "Got %i, Expected at least %i.", argc, 1);
+  LCHECK_TYPE("map-del", argv, 0, LVAL_MAP);
+  for (int i = 1; i < argc; i++) { LCHECK_KEY("map-del", argv, i); }
+
+  lmap* undo;
+  lval* x = lval_map_edit(argv[0], &undo);
+  for (int i = 1; i < argc; i++) { lmap_set(x->map, undo, argv[i], NULL); }
+  return x;
+}
+
+lval* builtin_map_len(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("map-len", argc, 1);
+  LCHECK_TYPE("map-len", argv, 0, LVAL_MAP);
+  return lval_num(lmap_of(argv[0])->count);
+}
+
+lval* builtin_map_keys(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("map-keys", argc, 1);
+  LCHECK_TYPE("map-keys", argv, 0, LVAL_MAP);
+  lmap* m = lmap_of(argv[0]);
+  return lval_list(m->count, m->keys);
+}
+
+lval* builtin_map_vals(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("map-vals", argc, 1);
+  LCHECK_TYPE("map-vals", argv, 0, LVAL_MAP);
+  lmap* m = lmap_of(argv[0]);
+  return lval_list(m->count, m->vals);
+}
+
+/* (map-fold f z m) calling (f acc key value) for each entry */
+lval* builtin_map_fold(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("map-fold", argc, 3);
+  LCHECK_TYPE("map-fold", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("map-fold", argv, 2, LVAL_MAP);
+
+  /* A call changing the map may give its entries to a new version, */
+  /* so fold over lists of them                                      */
+  lval* f = argv[0];
+  lmap* m = lmap_of(argv[2]);
+  lval* ks = lval_list(m->count, m->keys);
+  lval* vs = lval_list(m->count, m->vals);
+  lval* z = lval_copy(argv[1]);
+  LGC_PROTECT(ks);
+  LGC_PROTECT(vs);
+
+  for (int i = 0; i < ks->count && LTYPE(z) != LVAL_ERR; i++) {
+    lval* args[3] = { z, ks->cell[i], vs->cell[i] };
+    LGC_PROTECT(z);
+    lval* r = lval_call(e, f, 3, args);
+    LGC_UNPROTECT(1);
+    lval_del(z);
+    z = r;
+  }
+  LGC_UNPROTECT(2);
+  lval_del(ks);
+  lval_del(vs);
+  return z;
+}
+
+/* (vec x ...) or (vec {x ...}) giving a vector of the numbers, */
+/* which holds Floats if any of them is one                      */
+lval* builtin_vec(lenv* e, int argc, lval** argv) {
+  if (argc == 1 && LTYPE(argv[0]) == LVAL_QEXPR) {
+    argc = argv[0]->count;
+    argv = argv[0]->cell;
+  }
+  int floats = 0;
+  for (int i = 0; i < argc; i++) {
+    LCHECK(LTYPE(argv[i]) == LVAL_NUM || LTYPE(argv[i]) == LVAL_DBL,
+           "Function 'vec' passed %s for element %i. "
+           "Vectors hold only Numbers and Floats.",
+           ltype_name(LTYPE(argv[i])), i);
+    floats |= LTYPE(argv[i]) == LVAL_DBL;
   }
 
-  return 0;
+  if (floats) {
+    lval* x = lval_fvec(argc);
+    for (int i = 0; i < argc; i++) { x->dbls[i] = LDBL(argv[i]); }
+    return x;
+  }
+  lval* x = lval_vec(argc);
+  for (int i = 0; i < argc; i++) { x->nums[i] = LNUM(argv[i]); }
+  return x;
 }
 
+/* (vec-list v) giving the numbers of v as a Q-Expression */
+lval* builtin_vec_list(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-list", argc, 1);
+  LCHECK_TYPE("vec-list", argv, 0, LVAL_VEC);
 
-/* --- lenv functions --- */
+  lval* v = argv[0];
+  lval* x = lval_qexpr();
+  x->count = v->count;
+  x->cell = lcells_alloc(v->count);
+  for (int i = 0; i < v->count; i++) { x->cell[i] = lvec_nth(v, i); }
+  return x;
+}
 
-lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
-  e->par = NULL;
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
-  return e;
+/* (vec-range n) giving the vector of 0 up to n - 1 */
+lval* builtin_vec_range(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-range", argc, 1);
+  LCHECK_TYPE("vec-range", argv, 0, LVAL_NUM);
+  long n = LNUM(argv[0]);
+  LCHECK(n >= 0 && n <= INT_MAX,
+         "Function 'vec-range' passed invalid length %li.", n);
+
+  lval* x = lval_vec(n);
+  for (int i = 0; i < n; i++) { x->nums[i] = i; }
+  return x;
 }
 
-void lenv_del(lenv* e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+lval* builtin_vec_len(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-len", argc, 1);
+  LCHECK_TYPE("vec-len", argv, 0, LVAL_VEC);
+  return lval_num(argv[0]->count);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+lval* builtin_vec_nth(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-nth", argc, 2);
+  LCHECK_TYPE("vec-nth", argv, 0, LVAL_VEC);
+  LCHECK_TYPE("vec-nth", argv, 1, LVAL_NUM);
+  long n = LNUM(argv[1]);
+  LCHECK(n >= 0 && n < argv[0]->count,
+         "Function 'vec-nth' passed index %li out of range.", n);
+  return lvec_nth(argv[0], n);
+}
 
-  /* Iterate over all items in environment */
-  for (int i = 0; i < e->count; i++) {
-    /* Check if the stored string matches the symbol string */
-    /* If it does, return a copy of the value */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+lval* builtin_vec_sum(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-sum", argc, 1);
+  LCHECK_TYPE("vec-sum", argv, 0, LVAL_VEC);
+  if (argv[0]->floats) {
+    return lval_dbl(lvec_fsum(argv[0]->dbls, argv[0]->count));
   }
 
-  /* If no symbol found, check parent, otherwise error */
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unboud symbol '%s'", k->sym);
+  long hi, r;
+  unsigned long lo;
+  lvec_sum(argv[0]->nums, argv[0]->count, &hi, &lo);
+  if (!__builtin_mul_overflow(hi, 1L << 32, &r)
+      && !__builtin_add_overflow(r, (long)lo, &r)) {
+    return lval_num(r);
   }
+
+  /* Like '+', finish a sum that overflows as a Bignum */
+  lval* h = lval_num(hi);
+  lval* b = lval_num(1L << 32);
+  lval* l = lval_num((long)lo);
+  lval* x = lbig_op(h, b, LOPR_MUL);
+  lval* y = lbig_op(x, l, LOPR_ADD);
+  lval_del(h); lval_del(b); lval_del(l); lval_del(x);
+  return y;
 }
 
-lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
-  n->par = e->par;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
-  for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+lval* builtin_vec_min(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-min", argc, 1);
+  LCHECK_TYPE("vec-min", argv, 0, LVAL_VEC);
+  LCHECK_NOT_EMPTY("vec-min", argv, 0);
+  if (argv[0]->floats) {
+    double* a = argv[0]->dbls;
+    double x = a[0];
+    for (int i = 1; i < argv[0]->count; i++) { x = a[i] < x ? a[i] : x; }
+    return lval_dbl(x);
   }
-  return n;
+
+  long* a = argv[0]->nums;
+  long x = a[0];
+  for (int i = 1; i < argv[0]->count; i++) { x = a[i] < x ? a[i] : x; }
+  return lval_num(x);
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-  /* Iterate till e has no parent */
-  while (e->par) { e = e->par; }
-  /* Put value in e */
-  lenv_put(e, k, v);
+lval* builtin_vec_max(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-max", argc, 1);
+  LCHECK_TYPE("vec-max", argv, 0, LVAL_VEC);
+  LCHECK_NOT_EMPTY("vec-max", argv, 0);
+  if (argv[0]->floats) {
+    double* a = argv[0]->dbls;
+    double x = a[0];
+    for (int i = 1; i < argv[0]->count; i++) { x = a[i] > x ? a[i] : x; }
+    return lval_dbl(x);
+  }
+
+  long* a = argv[0]->nums;
+  long x = a[0];
+  for (int i = 1; i < argv[0]->count; i++) { x = a[i] > x ? a[i] : x; }
+  return lval_num(x);
 }
 
-void lenv_put(lenv* e, lval* k, lval*v) {
+lval* builtin_vec_dot(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-dot", argc, 2);
+  LCHECK_TYPE("vec-dot", argv, 0, LVAL_VEC);
+  LCHECK_TYPE("vec-dot", argv, 1, LVAL_VEC);
+  LCHECK(argv[0]->count == argv[1]->count,
+         "Function 'vec-dot' passed vectors of lengths %i and %i.",
+         argv[0]->count, argv[1]->count);
+
+  /* With Floats in either, the product is of Floats */
+  if (argv[0]->floats || argv[1]->floats) {
+    int n = argv[0]->count;
+    double* a = malloc(sizeof(double) * n);
+    double* b = malloc(sizeof(double) * n);
+    lvec_dbls(a, argv[0], n);
+    lvec_dbls(b, argv[1], n);
+    double d = lvec_fdot(a, b, n);
+    free(a);
+    free(b);
+    return lval_dbl(d);
+  }
 
-  /* Iterate over all items in enviroment */
-  /* This is to see of variable already exists */
-  for (int i = 0; i < e->count; i++) {
+  long* a = argv[0]->nums;
+  long* b = argv[1]->nums;
+  int over;
+  long r = lvec_dot(a, b, argv[0]->count, &over);
+  if (!over) { return lval_num(r); }
+
+  /* Redo a product that overflows exactly with Bignums */
+  lval* s = lval_num(0);
+  for (int i = 0; i < argv[0]->count; i++) {
+    lval* x = lval_num(a[i]);
+    lval* y = lval_num(b[i]);
+    lval* p = lbig_op(x, y, LOPR_MUL);
+    lval* t = lbig_op(s, p, LOPR_ADD);
+    lval_del(x); lval_del(y); lval_del(p); lval_del(s);
+    s = t;
+  }
+  return s;
+}
 
-    /* If variable is found, delete item at that position */
-    /* and replace with variable supplied by user */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
+/* Apply op elementwise across vectors of the same length, with any */
+/* numbers among them standing for a vector filled with that number */
+/* The result holds Floats if any of the arguments do               */
+lval* builtin_vec_op(lenv* e, int argc, lval** argv, char* func, lopr_t op) {
+  int n = -1;
+  int floats = 0;
+  for (int i = 0; i < argc; i++) {
+    if (LTYPE(argv[i]) == LVAL_VEC) {
+      LCHECK(n < 0 || argv[i]->count == n,
+             "Function '%s' passed vectors of lengths %i and %i.",
+             func, n, argv[i]->count);
+      n = argv[i]->count;
+      floats |= argv[i]->floats;
+    } else {
+      LCHECK(LTYPE(argv[i]) == LVAL_NUM || LTYPE(argv[i]) == LVAL_DBL,
+             "Function '%s' passed incorrect type for argument %i. "
+             "Got %s, Expected Vector, Number or Float.",
+             func, i, ltype_name(LTYPE(argv[i])));
+      floats |= LTYPE(argv[i]) == LVAL_DBL;
     }
   }
+  LCHECK(n >= 0, "Function '%s' passed no vector.", func);
 
-  /* If no existing entry found, allocate space for new entry */
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  if (floats) {
+    lval* x = lval_fvec(n);
+    lvec_dbls(x->dbls, argv[0], n);
+    double* t = NULL;
+    for (int i = 1; i < argc; i++) {
+      if (LTYPE(argv[i]) != LVAL_VEC) {
+        lvec_fop_num(x->dbls, LDBL(argv[i]), n, op);
+      } else if (argv[i]->floats) {
+        lvec_fop(x->dbls, argv[i]->dbls, n, op);
+      } else {
+        if (!t) { t = malloc(sizeof(double) * n); }
+        lvec_dbls(t, argv[i], n);
+        lvec_fop(x->dbls, t, n, op);
+      }
+    }
+    free(t);
+    return x;
+  }
 
-  /* Copy contents of lval and symbol string into new location */
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  lval* x = lval_vec(n);
+  if (LTYPE(argv[0]) == LVAL_VEC) {
+    if (n) { memcpy(x->nums, argv[0]->nums, sizeof(long) * n); }
+  } else {
+    for (int i = 0; i < n; i++) { x->nums[i] = LNUM(argv[0]); }
+  }
+
+  /* Elements have no room for Bignums, so overflow is an error */
+  int over = 0;
+  for (int i = 1; i < argc; i++) {
+    if (LTYPE(argv[i]) == LVAL_VEC) {
+      over |= lvec_op(x->nums, argv[i]->nums, n, op);
+    } else {
+      over |= lvec_op_num(x->nums, LNUM(argv[i]), n, op);
+    }
+  }
+  if (over) {
+    lval_del(x);
+    return lval_err("Function '%s' overflowed a Vector element.", func);
+  }
+  return x;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_fun(func);
-  lenv_put(e, k, v);
-  lval_del(k);
-  lval_del(v);
+lval* builtin_vec_add(lenv* e, int argc, lval** argv) {
+  return builtin_vec_op(e, argc, argv, "vec+", LOPR_ADD);
 }
 
-void lenv_add_builtins(lenv* e) {
-  /* List functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+lval* builtin_vec_sub(lenv* e, int argc, lval** argv) {
+  return builtin_vec_op(e, argc, argv, "vec-", LOPR_SUB);
+}
 
-  /* Mathematical functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+lval* builtin_vec_mul(lenv* e, int argc, lval** argv) {
+  return builtin_vec_op(e, argc, argv, "vec*", LOPR_MUL);
+}
 
-  /* Variable functions */
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "\\", builtin_lambda);
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=", builtin_put);
+/* Call f on element i of vector v, which must give a Number or Float */
+lval* builtin_vec_call(lenv* e, char* func, lval* f, lval* v, int i) {
+  lval* n = lvec_nth(v, i);
+  LGC_PROTECT(n);
+  lval* r = lval_call(e, f, 1, &n);
+  LGC_UNPROTECT(1);
+  lval_del(n);
+
+  if (LTYPE(r) != LVAL_NUM && LTYPE(r) != LVAL_DBL && LTYPE(r) != LVAL_ERR) {
+    lval* err = lval_err("Function '%s' passed function returning %s. "
+                         "Vectors hold only Numbers and Floats.", func,
+                         ltype_name(LTYPE(r)));
+    lval_del(r);
+    return err;
+  }
+  return r;
+}
 
-  /* Comparison functions */
-  lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, ">",  builtin_gt);
-  lenv_add_builtin(e, "<",  builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
+lval* builtin_vec_map(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-map", argc, 2);
+  LCHECK_TYPE("vec-map", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("vec-map", argv, 1, LVAL_VEC);
 
-  /* String functions */
-  lenv_add_builtin(e, "load",  builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+  lval* f = argv[0];
+  lval* v = argv[1];
 
+  /* The results hold Floats from the first that is one */
+  lval* x = v->floats ? lval_fvec(v->count) : lval_vec(v->count);
+  LGC_PROTECT(x);
+  for (int i = 0; i < v->count; i++) {
+    lval* r = builtin_vec_call(e, "vec-map", f, v, i);
+    if (LTYPE(r) == LVAL_ERR) {
+      lval_del(x);
+      x = r;
+      break;
+    }
+    if (!x->floats && LTYPE(r) == LVAL_DBL) { lvec_promote(x, i); }
+    if (x->floats) {
+      x->dbls[i] = LDBL(r);
+    } else {
+      x->nums[i] = LNUM(r);
+    }
+    lval_del(r);
+  }
+  LGC_UNPROTECT(1);
+  return x;
 }
 
+lval* builtin_vec_filter(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("vec-filter", argc, 2);
+  LCHECK_TYPE("vec-filter", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("vec-filter", argv, 1, LVAL_VEC);
 
-/* --- builtin functions --- */
+  lval* f = argv[0];
+  lval* v = argv[1];
 
-lval* builtin_head(lenv* e, lval* a) {
-  LASSERT_NUM_ARGS("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a, 0);
+  /* Kept numbers are gathered at the front, then the rest cut off */
+  lval* x = v->floats ? lval_fvec(v->count) : lval_vec(v->count);
+  int n = 0;
+  LGC_PROTECT(x);
+  for (int i = 0; i < v->count; i++) {
+    lval* r = builtin_vec_call(e, "vec-filter", f, v, i);
+
+    /* Like the condition of 'if', the result must be a Number */
+    if (LTYPE(r) == LVAL_DBL) {
+      lval_del(r);
+      r = lval_err("Function 'vec-filter' passed function returning %s. "
+                   "Expected %s.", ltype_name(LVAL_DBL),
+                   ltype_name(LVAL_NUM));
+    }
+    if (LTYPE(r) == LVAL_ERR) {
+      lval_del(x);
+      x = r;
+      break;
+    }
+    if (LNUM(r)) {
+      if (v->floats) {
+        x->dbls[n++] = v->dbls[i];
+      } else {
+        x->nums[n++] = v->nums[i];
+      }
+    }
+    lval_del(r);
+  }
+  LGC_UNPROTECT(1);
 
-  lval* v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+  if (LTYPE(x) == LVAL_VEC) {
+    x->count = n;
+    if (n == 0) {
+      free(x->nums);
+      x->nums = NULL;
+    }
+  }
+  return x;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-  LASSERT_NUM_ARGS("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("tail", a, 0);
+/* (memo f) or (memo f capacity) giving a function which caches the */
+/* results of calling f, dropping the least recently used first     */
+lval* builtin_memo(lenv* e, int argc, lval** argv) {
+  LCHECK(argc == 1 || argc == 2,
+         "Function 'memo' passed incorrect number of arguments. "
+         "Got %i, Expected %i or %i.", argc, 1, 2);
+  LCHECK_TYPE("memo", argv, 0, LVAL_FUN);
+
+  long capacity = LMEMO_CAPACITY;
+  if (argc == 2) {
+    LCHECK_TYPE("memo", argv, 1, LVAL_NUM);
+    capacity = LNUM(argv[1]);
+    LCHECK(capacity >= 0 && capacity <= INT_MAX / 2,
+           "Function 'memo' passed capacity %li out of range.", capacity);
+  }
 
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v,0));
+  lval* v = lval_prim(builtin_memoized);
+  v->body = lval_copy(argv[0]);
+  v->memo = lmemo_new(capacity);
   return v;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
+/* Counters of a memoized function as {hits misses evictions size capacity} */
+lval* builtin_memo_stats(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("memo-stats", argc, 1);
+  LCHECK(LTYPE(argv[0]) == LVAL_FUN && LMEMO_P(argv[0]),
+         "Function 'memo-stats' passed %s, Expected memoized Function.",
+         ltype_name(LTYPE(argv[0])));
+
+  lmemo* m = argv[0]->memo;
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_num(m->hits));
+  x = lval_add(x, lval_num(m->misses));
+  x = lval_add(x, lval_num(m->evictions));
+  x = lval_add(x, lval_num(m->count));
+  x = lval_add(x, lval_num(m->capacity));
+  return x;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-  LASSERT_NUM_ARGS("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+/* Memoized functions are called by lval_call, which has their cache */
+lval* builtin_memoized(lenv* e, int argc, lval** argv) {
+  return lval_err("Memoized function called without its cache.");
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
-  }
-
-  lval* x = lval_pop(a, 0);
+/* Call a function with the items of a list as its arguments */
+lval* builtin_apply(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("apply", argc, 2);
+  LCHECK_TYPE("apply", argv, 0, LVAL_FUN);
+  LCHECK_TYPE("apply", argv, 1, LVAL_QEXPR);
 
-  while (a->count) {
-    x = lval_join(x, lval_pop(a,0));
+  /* As when evaluating an S-Expression, nothing to call it with */
+  /* gives the function itself unless it is a builtin            */
+  if (argv[1]->count == 0 && !LBUILTIN_P(argv[0])) {
+    return lval_copy(argv[0]);
   }
-
-  lval_del(a);
-  return x;
+  return lval_call(e, argv[0], argv[1]->count, argv[1]->cell);
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+/* Names of operators, for error messages */
+char* lopr_name[] = { "+", "-", "*", "/", ">", "<", ">=", "<=", "==", "!=" };
+
+/* Both arguments of a call with two are fixnums */
+#define LFIX_PAIR(argc, argv) \
+  ((argc) == 2 && LFIX_P((argv)[0]) && LFIX_P((argv)[1]))
 
-  /* Ensure all arguments are numbers */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
+lval* builtin_op(lenv* e, int argc, lval** argv, lopr_t op) {
+
+  /* With no arguments '+' and '*' give their identities */
+  if (argc == 0) {
+    LCHECK(op == LOPR_ADD || op == LOPR_MUL,
+           "Function '%s' passed incorrect number of arguments. "
+           "Got %i, Expected at least %i.", lopr_name[op], argc, 1);
+    return lval_num(op == LOPR_MUL);
   }
 
-  /* Pop the first element */
-  lval* x = lval_pop(a, 0);
+  /* Ensure all arguments are numbers, noting whether any is a Float */
+  int dbl = 0;
+  for (int i = 0; i < argc; i++) {
+    if (LTYPE(argv[i]) == LVAL_DBL) {
+      dbl = 1;
+      continue;
+    }
+    if (LTYPE(argv[i]) == LVAL_BIG) { continue; }
+    LCHECK_TYPE(lopr_name[op], argv, i, LVAL_NUM);
+  }
+  if (dbl) { return builtin_op_dbl(argc, argv, op); }
 
   /* If no arguments and sub the perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  if (op == LOPR_SUB && argc == 1) {
+    if (LTYPE(argv[0]) == LVAL_NUM && LNUM(argv[0]) != LONG_MIN) {
+      return lval_num(-LNUM(argv[0]));
+    }
+    return lbig_op(lval_num(0), argv[0], LOPR_SUB);
   }
 
-  /* While there are still elements remaining */
-  while (a->count > 0) {
+  /* Fold in the elements as longs while they are Numbers and */
+  /* nothing overflows                                        */
+  int i = 1;
+  long x = 0;
+  if (LTYPE(argv[0]) == LVAL_NUM) {
+    x = LNUM(argv[0]);
+    for (; i < argc && LTYPE(argv[i]) == LVAL_NUM; i++) {
+      long y = LNUM(argv[i]);
+      long r = 0;
+      int over = 0;
+
+      switch (op) {
+      case LOPR_ADD: over = __builtin_add_overflow(x, y, &r); break;
+      case LOPR_SUB: over = __builtin_sub_overflow(x, y, &r); break;
+      case LOPR_MUL: over = __builtin_mul_overflow(x, y, &r); break;
+      case LOPR_DIV:
+        if (y == 0) {
+          return lval_err("Division by zero!");
+        }
+        over = (x == LONG_MIN && y == -1);
+        r = over ? 0 : x / y;
+        break;
+      default: break;
+      }
+
+      if (over) { break; }
+      x = r;
+    }
+    if (i == argc) { return lval_num(x); }
+  }
+
+  /* Then fold in the rest as Bignums */
+  lval* z = LTYPE(argv[0]) == LVAL_BIG ? lval_copy(argv[0]) : lval_num(x);
+  for (; i < argc; i++) {
+    if (op == LOPR_DIV && LTYPE(argv[i]) == LVAL_NUM && LNUM(argv[i]) == 0) {
+      lval_del(z);
+      return lval_err("Division by zero!");
+    }
+    lval* r = lbig_op(z, argv[i], op);
+    lval_del(z);
+    z = r;
+  }
+  return z;
+}
 
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
+/* As builtin_op when any argument is a Float, promoting the integers */
+lval* builtin_op_dbl(int argc, lval** argv, lopr_t op) {
+  double x = LDBL(argv[0]);
+  if (op == LOPR_SUB && argc == 1) {
+    x = -x;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    double y = LDBL(argv[i]);
 
-    if(strcmp(op, "+") == 0) { x->num += y->num; };
-    if(strcmp(op, "-") == 0) { x->num -= y->num; };
-    if(strcmp(op, "*") == 0) { x->num *= y->num; };
-    if(strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero!"); break;
+    switch (op) {
+    case LOPR_ADD: x += y; break;
+    case LOPR_SUB: x -= y; break;
+    case LOPR_MUL: x *= y; break;
+    case LOPR_DIV:
+      if (y == 0) {
+        return lval_err("Division by zero!");
       }
-      x->num /= y->num;
+      x /= y;
+      break;
+    default: break;
     }
+  }
 
-    lval_del(y);
+  return lval_dbl(x);
+}
+
+/* (int x) giving Float x truncated towards zero */
+lval* builtin_int(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("int", argc, 1);
+  if (LINT_P(argv[0])) { return lval_copy(argv[0]); }
+  LCHECK_TYPE("int", argv, 0, LVAL_DBL);
+
+  double x = argv[0]->dbl;
+  LCHECK(x - x == 0, "Function 'int' passed %g, which is not finite.", x);
+  if (x > (double)LONG_MIN - 1 && x < (double)LONG_MAX + 1) {
+    return lval_num((long)x);
   }
+  return lbig_of_dbl(x);
+}
 
-  lval_del(a);
-  return x;
+/* (float x) giving integer x as a Float */
+lval* builtin_float(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("float", argc, 1);
+  if (LTYPE(argv[0]) == LVAL_DBL) { return lval_copy(argv[0]); }
+  LCHECK(LINT_P(argv[0]),
+         "Function 'float' passed incorrect type for argument 0. "
+         "Got %s, Expected %s.", ltype_name(LTYPE(argv[0])),
+         ltype_name(LVAL_NUM));
+  return lval_dbl(LDBL(argv[0]));
 }
 
-lval* builtin(lenv* e, lval* a, char* func) {
-  if (strcmp("list", func) == 0) { return builtin_list(e, a); }
-  if (strcmp("tail", func) == 0) { return builtin_tail(e, a); }
-  if (strcmp("tail", func) == 0) { return builtin_tail(e, a); }
-  if (strcmp("join", func) == 0) { return builtin_join(e, a); }
-  if (strcmp("eval", func) == 0) { return builtin_eval(e, a); }
-  if (strstr("+-/*", func)) { return builtin_op(e, a, func); }
-  lval_del(a);
+lval* builtin(lenv* e, int argc, lval** argv, char* func) {
+  if (strcmp("list", func) == 0) { return builtin_list(e, argc, argv); }
+  if (strcmp("tail", func) == 0) { return builtin_tail(e, argc, argv); }
+  if (strcmp("tail", func) == 0) { return builtin_tail(e, argc, argv); }
+  if (strcmp("join", func) == 0) { return builtin_join(e, argc, argv); }
+  if (strcmp("eval", func) == 0) { return builtin_eval(e, argc, argv); }
+  for (lopr_t op = LOPR_ADD; op <= LOPR_DIV; op++) {
+    if (strcmp(lopr_name[op], func) == 0) {
+      return builtin_op(e, argc, argv, op);
+    }
+  }
   return lval_err("Unknown function!");
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+/* Calls on two fixnums, by far the most common, skip the checks */
+
+lval* builtin_add(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(LNUM(argv[0]) + LNUM(argv[1])); }
+  return builtin_op(e, argc, argv, LOPR_ADD);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+lval* builtin_sub(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(LNUM(argv[0]) - LNUM(argv[1])); }
+  return builtin_op(e, argc, argv, LOPR_SUB);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+/* Sums and differences of fixnums fit in a long, but products may not */
+lval* builtin_mul(lenv* e, int argc, lval** argv) {
+  long r;
+  if (LFIX_PAIR(argc, argv)
+      && !__builtin_mul_overflow(LNUM(argv[0]), LNUM(argv[1]), &r)) {
+    return lval_num(r);
+  }
+  return builtin_op(e, argc, argv, LOPR_MUL);
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+lval* builtin_div(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv) && LNUM(argv[1]) != 0) {
+    return lval_num(LNUM(argv[0]) / LNUM(argv[1]));
+  }
+  return builtin_op(e, argc, argv, LOPR_DIV);
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-  return builtin_var(e, a, "def");
+lval* builtin_def(lenv* e, int argc, lval** argv) {
+  return builtin_var(e, argc, argv, 0);
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-  return builtin_var(e, a, "=");
+lval* builtin_put(lenv* e, int argc, lval** argv) {
+  return builtin_var(e, argc, argv, 1);
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+/* 'def' binds globally, or '=' locally if local is set */
+lval* builtin_var(lenv* e, int argc, lval** argv, int local) {
+  char* func = local ? "=" : "def";
+
+  /* Like (def {}), nothing to define */
+  if (argc == 0) { return lval_sexpr(); }
+  LCHECK_TYPE(func, argv, 0, LVAL_QEXPR);
 
   /* First argument is symbol list */
-  lval* syms = a->cell[0];
+  lval* syms = argv[0];
 
   /* Ensure all elements of first list are symbols */
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-            "Function %s cannot define non-symbol. "
-            "Got %s, Expected %s.",
-            func,
-            ltype_name(syms->cell[i]->type),
-            ltype_name(LVAL_SYM));
+    LCHECK(LTYPE(syms->cell[i]) == LVAL_SYM,
+           "Function %s cannot define non-symbol. "
+           "Got %s, Expected %s.",
+           func,
+           ltype_name(LTYPE(syms->cell[i])),
+           ltype_name(LVAL_SYM));
   }
 
   /* Check correct number of symbols and values */
-  LASSERT(a, syms->count == a->count - 1,
-          "Function %s passed too many arguments for symbols. "
-          "Got %i, Expected %i",
-          func,
-          syms->count,
-          a->count - 1);
+  LCHECK(syms->count == argc - 1,
+         "Function %s passed too many arguments for symbols. "
+         "Got %i, Expected %i",
+         func,
+         syms->count,
+         argc - 1);
 
   /* Assign copies of values to symbols */
   for (int i = 0; i < syms->count; i++) {
-    /* If 'def', define in globally. If 'put' define in locally. */
-    if (strcmp(func, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i + 1]);
-    }
-    if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    if (local) {
+      lenv_put(e, syms->cell[i], argv[i + 1]);
+    } else {
+      lenv_def(e, syms->cell[i], argv[i + 1]);
     }
   }
+  if (local) { e->extended = 1; }
 
-  lval_del(a);
   return lval_sexpr();
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
+lval* builtin_lambda(lenv* e, int argc, lval** argv) {
   /* Check two arguments, each of which are Q-Expressions */
-  LASSERT_NUM_ARGS("\\", a, 2);
-  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+  LCHECK_NUM_ARGS("\\", argc, 2);
+  LCHECK_TYPE("\\", argv, 0, LVAL_QEXPR);
+  LCHECK_TYPE("\\", argv, 1, LVAL_QEXPR);
 
   /* Check first Q-Expression contains only symbols */
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-            "Cannot define non-symbol. Got %s, Expected %s.",
-            ltype_name(a->cell[0]->cell[i]->type),
-            ltype_name(LVAL_SYM));
+  for (int i = 0; i < argv[0]->count; i++) {
+    LCHECK((LTYPE(argv[0]->cell[i]) == LVAL_SYM),
+           "Cannot define non-symbol. Got %s, Expected %s.",
+           ltype_name(LTYPE(argv[0]->cell[i])),
+           ltype_name(LVAL_SYM));
   }
 
-  /* Pop first two arguments and pass them to lval_lambda */
-  lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a, 0);
-  lval_del(a);
-
-  return lval_lambda(formals, body);
+  /* Share formals and body with the new lambda */
+  return lval_closure(e, lval_copy(argv[0]), lval_copy(argv[1]));
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM_ARGS("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-  /* Parse file given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-
-    /* Read contents */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
-
-    /* Evaluate each expression */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      /* If evaluation leads to error, print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
+/* (fun {name formal ...} {body}) defining name globally as a lambda. */
+/* As a builtin it is called in the scope the body was written in,   */
+/* which the lambda closes over just as one made there by '\' would  */
+lval* builtin_fun(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("fun", argc, 2);
+  LCHECK_TYPE("fun", argv, 0, LVAL_QEXPR);
+  LCHECK_TYPE("fun", argv, 1, LVAL_QEXPR);
+  LCHECK_NOT_EMPTY("fun", argv, 0);
+
+  /* Check the name and formals are all symbols */
+  for (int i = 0; i < argv[0]->count; i++) {
+    LCHECK((LTYPE(argv[0]->cell[i]) == LVAL_SYM),
+           "Cannot define non-symbol. Got %s, Expected %s.",
+           ltype_name(LTYPE(argv[0]->cell[i])),
+           ltype_name(LVAL_SYM));
+  }
 
-    /* Delete expressions and arguments */
-    lval_del(expr);
-    lval_del(a);
+  lval* formals = lval_list(argv[0]->count - 1, &argv[0]->cell[1]);
+  lval* v = lval_closure(e, formals, lval_copy(argv[1]));
+  lenv_def(e, argv[0]->cell[0], v);
+  lval_del(v);
+  return lval_sexpr();
+}
 
-    /* Return empty list */
-    return lval_sexpr();
+lval* builtin_load(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("load", argc, 1);
+  LCHECK_TYPE("load", argv, 0, LVAL_STR);
 
-  } else {
-    /* Get parse error as string */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+  /* Read file given by string name */
+  FILE* f = fopen(argv[0]->str, "rb");
+  if (!f) {
+    return lval_err("Could not load library %s: error: Unable to open file!",
+                    argv[0]->str);
+  }
 
-    /* Create new error message using it */
-    lval* err = lval_err("Could not load library %s", err_msg);
-    free(err_msg);
-    lval_del(a);
+  /* Read and evaluate one expression at a time, so only the */
+  /* expression being evaluated is held in memory            */
+  lreader r;
+  lread_open(&r, argv[0]->str, f);
+  lval* expr;
+  while ((expr = lread_next(&r)) && LTYPE(expr) != LVAL_ERR) {
+    lval* x = lval_eval(e, expr);
+    /* If evaluation leads to error, print it */
+    if (LTYPE(x) == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+  lread_close(&r);
+  fclose(f);
 
-    /* Cleanup and return error */
+  if (expr) {
+    /* Create new error message using the read error */
+    lval* err = lval_err("Could not load library %s", expr->err);
+    lval_del(expr);
     return err;
   }
+
+  /* Return empty list */
+  return lval_sexpr();
 }
 
-lval* builtin_print(lenv* e, lval* a) {
+lval* builtin_print(lenv* e, int argc, lval** argv) {
 
   /* Print each argument followed by a space */
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]);
+  for (int i = 0; i < argc; i++) {
+    lval_print(argv[i]);
     putchar(' ');
   }
 
-  /* Print a newline and delete arguments */
+  /* Print a newline */
   putchar('\n');
-  lval_del(a);
 
   return lval_sexpr();
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-  LASSERT_NUM_ARGS("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* (show x) giving the text that print shows for x */
+lval* builtin_show(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("show", argc, 1);
 
-  /* Construct error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+  char* text;
+  size_t len;
+  FILE* out = lval_out;
+  lval_out = open_memstream(&text, &len);
+  lval_print(argv[0]);
+  fclose(lval_out);
+  lval_out = out;
+
+  lval* x = lval_str(text);
+  free(text);
+  return x;
+}
 
-  /* Delete arguments and return */
-  lval_del(a);
-  return err;
+lval* builtin_error(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("error", argc, 1);
+  LCHECK_TYPE("error", argv, 0, LVAL_STR);
+
+  /* Construct error from first argument */
+  return lval_err(argv[0]->str);
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
+/* (catch {expr}) evaluating like 'eval', but giving the message of an */
+/* Error as a String, so that errors can be checked for               */
+lval* builtin_catch(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("catch", argc, 1);
+  LCHECK_TYPE("catch", argv, 0, LVAL_QEXPR);
+
+  lval* r = lval_eval_list(e, argv[0]);
+  if (LTYPE(r) != LVAL_ERR) { return r; }
+  lval* x = lval_str(r->err);
+  lval_del(r);
+  return x;
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
+lval* builtin_gt(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(LNUM(argv[0]) > LNUM(argv[1])); }
+  return builtin_ord(e, argc, argv, LOPR_GT);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
+lval* builtin_lt(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(LNUM(argv[0]) < LNUM(argv[1])); }
+  return builtin_ord(e, argc, argv, LOPR_LT);
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
+lval* builtin_ge(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(LNUM(argv[0]) >= LNUM(argv[1])); }
+  return builtin_ord(e, argc, argv, LOPR_GE);
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM_ARGS(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+lval* builtin_le(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(LNUM(argv[0]) <= LNUM(argv[1])); }
+  return builtin_ord(e, argc, argv, LOPR_LE);
+}
 
-  int r;
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
+lval* builtin_ord(lenv* e, int argc, lval** argv, lopr_t op) {
+  LCHECK_NUM_ARGS(lopr_name[op], argc, 2);
+  for (int i = 0; i < 2; i++) {
+    if (LTYPE(argv[i]) != LVAL_DBL && LTYPE(argv[i]) != LVAL_BIG) {
+      LCHECK_TYPE(lopr_name[op], argv, i, LVAL_NUM);
+    }
   }
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
+
+  /* Compare as doubles if either is a Float */
+  if (LTYPE(argv[0]) == LVAL_DBL || LTYPE(argv[1]) == LVAL_DBL) {
+    double x = LDBL(argv[0]);
+    double y = LDBL(argv[1]);
+    int r = 0;
+    switch (op) {
+    case LOPR_GT: r = (x > y); break;
+    case LOPR_LT: r = (x < y); break;
+    case LOPR_GE: r = (x >= y); break;
+    case LOPR_LE: r = (x <= y); break;
+    default: break;
+    }
+    return lval_num(r);
   }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
+
+  /* Bignums by sign and magnitude, and otherwise as longs */
+  long x = LNUM(argv[0]);
+  long y = LNUM(argv[1]);
+  if (LTYPE(argv[0]) == LVAL_BIG || LTYPE(argv[1]) == LVAL_BIG) {
+    x = lbig_cmp(argv[0], argv[1]);
+    y = 0;
   }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+  int r = 0;
+  switch (op) {
+  case LOPR_GT: r = (x > y); break;
+  case LOPR_LT: r = (x < y); break;
+  case LOPR_GE: r = (x >= y); break;
+  case LOPR_LE: r = (x <= y); break;
+  default: break;
   }
-  lval_del(a);
   return lval_num(r);
 
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM_ARGS(op, a, 2);
+lval* builtin_cmp(lenv* e, int argc, lval** argv, lopr_t op) {
+  LCHECK_NUM_ARGS(lopr_name[op], argc, 2);
+
+  int r = lval_eq(argv[0], argv[1]);
+  return lval_num(op == LOPR_EQ ? r : !r);
+}
+
+/* Fixnums are equal exactly when their encodings are */
+
+lval* builtin_eq(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(argv[0] == argv[1]); }
+  return builtin_cmp(e, argc, argv, LOPR_EQ);
+}
+
+lval* builtin_ne(lenv* e, int argc, lval** argv) {
+  if (LFIX_PAIR(argc, argv)) { return lval_num(argv[0] != argv[1]); }
+  return builtin_cmp(e, argc, argv, LOPR_NE);
+}
+
+lval* builtin_if(lenv* e, int argc, lval** argv) {
+  lval* x = builtin_if_expr(e, argc, argv);
+  if (LTYPE(x) == LVAL_ERR) { return x; }
+  lval* r = lval_eval_list(e, x);
+  lval_del(x);
+  return r;
+}
+
+/* Check arguments to 'if' and return the branch whose cells are evaluated */
+lval* builtin_if_expr(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("if", argc, 3);
+  LCHECK_TYPE("if", argv, 0, LVAL_NUM);
+  LCHECK_TYPE("if", argv, 1, LVAL_QEXPR);
+  LCHECK_TYPE("if", argv, 2, LVAL_QEXPR);
+
+  /* If condition is true, take first expression, otherwise second */
+  return lval_copy(LNUM(argv[0]) ? argv[1] : argv[2]);
+}
+
+/* Evaluate a Q-Expression's cells in a new scope, which '=' defines in */
+lval* builtin_let(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("let", argc, 1);
+  LCHECK_TYPE("let", argv, 0, LVAL_QEXPR);
+
+  lenv* n = lenv_new();
+  n->par = (e == lenv_global) ? NULL : lenv_ref(e);
+  n->dyn = e;
+
+  LGC_PROTECT_ENV(n);
+  lval* r = lval_eval_list(n, argv[0]);
+  LGC_UNPROTECT_ENV(1);
+  lenv_leave(n);
+  return r;
+}
+
+/* Arguments were evaluated in order by the call, so give the last */
+lval* builtin_do(lenv* e, int argc, lval** argv) {
+  return argc ? lval_copy(argv[argc - 1]) : lval_qexpr();
+}
+
+/* Code whose cells evaluate as an S-Expression to expression x */
+lval* lval_code(lval* x) {
+  if (LTYPE(x) == LVAL_SEXPR) { return lval_copy(x); }
+  return lval_add(lval_qexpr(), lval_copy(x));
+}
+
+/* Check arguments from i on are {test expr} clauses */
+lval* builtin_clauses(char* func, int argc, lval** argv, int i) {
+  for (; i < argc; i++) {
+    LCHECK_TYPE(func, argv, i, LVAL_QEXPR);
+    LCHECK(argv[i]->count == 2,
+           "Function '%s' passed clause of %i expressions for argument %i. "
+           "Expected 2.", func, argv[i]->count, i);
+  }
+  return NULL;
+}
+
+lval* builtin_select(lenv* e, int argc, lval** argv) {
+  lval* x = builtin_select_expr(e, argc, argv);
+  if (LTYPE(x) == LVAL_ERR) { return x; }
+  lval* r = lval_eval_list(e, x);
+  lval_del(x);
+  return r;
+}
+
+/* Evaluate the tests of 'select' in turn, returning the code of the */
+/* expression of the first to hold                                   */
+lval* builtin_select_expr(lenv* e, int argc, lval** argv) {
+  lval* err = builtin_clauses("select", argc, argv, 0);
+  if (err) { return err; }
+
+  /* Tests may move the value stack argv is on */
+  lval** cs = lcells_alloc(argc);
+  for (int i = 0; i < argc; i++) { cs[i] = argv[i]; }
+
+  lval* r = NULL;
+  for (int i = 0; i < argc && !r; i++) {
+    lval* t = lval_eval_expr(e, cs[i]->cell[0]);
+    if (LTYPE(t) == LVAL_NUM) {
+      if (LNUM(t)) { r = lval_code(cs[i]->cell[1]); }
+    } else if (LTYPE(t) == LVAL_ERR) {
+      r = lval_copy(t);
+    } else {
+      r = lval_err("Function 'select' passed incorrect type for argument %i. "
+                   "Got %s, Expected %s.",
+                   i, ltype_name(LTYPE(t)), ltype_name(LVAL_NUM));
+    }
+    lval_del(t);
+  }
+
+  lcells_free(cs, argc);
+  return r ? r : lval_err("No selection found");
+}
+
+lval* builtin_case(lenv* e, int argc, lval** argv) {
+  lval* x = builtin_case_expr(e, argc, argv);
+  if (LTYPE(x) == LVAL_ERR) { return x; }
+  lval* r = lval_eval_list(e, x);
+  lval_del(x);
+  return r;
+}
+
+/* Evaluate the keys of 'case' in turn, returning the code of the */
+/* expression of the first equal to its first argument            */
+lval* builtin_case_expr(lenv* e, int argc, lval** argv) {
+  LCHECK(argc >= 1,
+         "Function 'case' passed incorrect number of arguments. "
+         "Got %i, Expected at least %i.", argc, 1);
+  lval* err = builtin_clauses("case", argc, argv, 1);
+  if (err) { return err; }
+
+  /* Keys may move the value stack argv is on */
+  lval** cs = lcells_alloc(argc);
+  for (int i = 0; i < argc; i++) { cs[i] = argv[i]; }
+
+  lval* r = NULL;
+  for (int i = 1; i < argc && !r; i++) {
+    lval* k = lval_eval_expr(e, cs[i]->cell[0]);
+    if (LTYPE(k) == LVAL_ERR) {
+      r = lval_copy(k);
+    } else if (lval_eq(cs[0], k)) {
+      r = lval_code(cs[i]->cell[1]);
+    }
+    lval_del(k);
+  }
+
+  lcells_free(cs, argc);
+  return r ? r : lval_err("No case found");
+}
+
+/* 'and' and 'or' when not compiled inline, so both were evaluated */
+lval* builtin_logic(lenv* e, int argc, lval** argv, lform_t form) {
+  char* func = lform_name[form];
+  LCHECK_NUM_ARGS(func, argc, 2);
+  LCHECK_TYPE(func, argv, 0, LVAL_NUM);
+  LCHECK_TYPE(func, argv, 1, LVAL_NUM);
+
+  int x = LNUM(argv[0]) != 0;
+  int y = LNUM(argv[1]) != 0;
+  return lval_num(form == LFORM_AND ? x && y : x || y);
+}
+
+lval* builtin_and(lenv* e, int argc, lval** argv) {
+  return builtin_logic(e, argc, argv, LFORM_AND);
+}
+
+lval* builtin_or(lenv* e, int argc, lval** argv) {
+  return builtin_logic(e, argc, argv, LFORM_OR);
+}
+
+/* Scope of a 'loop', whose variables 'recur' assigns in place */
+lenv* lloop_scope(lenv* e) {
+  lenv* n = lenv_new();
+  n->par = (e == lenv_global) ? NULL : lenv_ref(e);
+  n->dyn = e;
+  return n;
+}
+
+/* Bind k in n, returning the slot it is held in */
+int lloop_bind(lenv* n, lval* k, lval* v) {
+  lenv_put(n, k, v);
+  return lenv_find(n, k->sym);
+}
+
+/* Replace the value in slot i of n */
+void lloop_set(lenv* n, int i, lval* v) {
+  lval_del(n->vals[i]);
+  n->vals[i] = v;
+}
 
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
+/* Evaluate {test} and give whether it holds, or an error in x */
+int lloop_test(lenv* e, lval* test, lval** x) {
+  lval* t = lval_eval_list(e, test);
+  if (LTYPE(t) == LVAL_NUM) {
+    int r = LNUM(t) != 0;
+    lval_del(t);
+    return r;
   }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
+  if (LTYPE(t) == LVAL_ERR) {
+    *x = t;
+    return 0;
   }
-  lval_del(a);
-  return lval_num(r);
+  *x = lval_err("Function 'while' passed incorrect type for argument 0. "
+                "Got %s, Expected %s.",
+                ltype_name(LTYPE(t)), ltype_name(LVAL_NUM));
+  lval_del(t);
+  return 0;
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "==");
+/* (while {test} {body}) evaluating body in the current scope */
+lval* builtin_while(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("while", argc, 2);
+  LCHECK_TYPE("while", argv, 0, LVAL_QEXPR);
+  LCHECK_TYPE("while", argv, 1, LVAL_QEXPR);
+
+  /* Both stay on the value stack while argv itself may move */
+  lval* test = argv[0];
+  lval* body = argv[1];
+
+  lval* x = NULL;
+  while (lloop_test(e, test, &x)) {
+    lval* r = lval_eval_list(e, body);
+    if (LTYPE(r) == LVAL_ERR) { return r; }
+    lval_del(r);
+#ifdef LISPY_GC
+    lgc_safepoint();
+#endif
+  }
+  return x ? x : lval_sexpr();
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "!=");
+/* (dotimes {i n} {body}) evaluating body with i from 0 below n. Like */
+/* 'while' the body runs in the current scope, where i is bound as    */
+/* '=' would and then assigned in place                               */
+lval* builtin_dotimes(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("dotimes", argc, 2);
+  LCHECK_TYPE("dotimes", argv, 0, LVAL_QEXPR);
+  LCHECK_TYPE("dotimes", argv, 1, LVAL_QEXPR);
+  LCHECK(argv[0]->count == 2 && LTYPE(argv[0]->cell[0]) == LVAL_SYM,
+         "Function 'dotimes' passed incorrect binding. "
+         "Expected a symbol and a count.");
+
+  lval* var = argv[0];
+  lval* body = argv[1];
+
+  lval* n = lval_eval_expr(e, var->cell[1]);
+  if (LTYPE(n) == LVAL_ERR) { return n; }
+  if (LTYPE(n) != LVAL_NUM) {
+    lval* err = lval_err("Function 'dotimes' passed incorrect type for count. "
+                         "Got %s, Expected %s.",
+                         ltype_name(LTYPE(n)), ltype_name(LVAL_NUM));
+    lval_del(n);
+    return err;
+  }
+  long count = LNUM(n);
+  lval_del(n);
+
+  lval* i = lval_num(0);
+  int slot = lloop_bind(e, var->cell[0], i);
+  e->extended = 1;
+  lval_del(i);
+
+  for (long j = 0; j < count; j++) {
+    lloop_set(e, slot, lval_num(j));
+    lval* r = lval_eval_list(e, body);
+    if (LTYPE(r) == LVAL_ERR) { return r; }
+    lval_del(r);
+#ifdef LISPY_GC
+    lgc_safepoint();
+#endif
+  }
+  return lval_sexpr();
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-  LASSERT_NUM_ARGS("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+/* Loops running, innermost last, which 'recur' passes values to */
+typedef struct {
+  lenv* scope;
+  int count;
+  int* slots;
+  int recur;
+} lloop;
+
+lloop* lloops = NULL;
+int lloop_count = 0;
+int lloop_cap = 0;
+
+/* (loop {var init ...} {body}) evaluating body until it does not end */
+/* with (recur value ...), which assigns the variables in place. In   */
+/* lambda bodies loops are compiled by lcode_compile_loop instead     */
+lval* builtin_loop(lenv* e, int argc, lval** argv) {
+  LCHECK_NUM_ARGS("loop", argc, 2);
+  LCHECK_TYPE("loop", argv, 0, LVAL_QEXPR);
+  LCHECK_TYPE("loop", argv, 1, LVAL_QEXPR);
+
+  lval* vars = argv[0];
+  lval* body = argv[1];
+  LCHECK(vars->count % 2 == 0,
+         "Function 'loop' passed incorrect bindings. "
+         "Expected pairs of symbol and value.");
+  for (int i = 0; i < vars->count; i += 2) {
+    LCHECK(LTYPE(vars->cell[i]) == LVAL_SYM,
+           "Function 'loop' cannot bind non-symbol. Got %s, Expected %s.",
+           ltype_name(LTYPE(vars->cell[i])), ltype_name(LVAL_SYM));
+  }
 
-  /* Mark both expressions as evaluable */
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+  /* Initial values are evaluated in the enclosing scope */
+  lenv* scope = lloop_scope(e);
+  LGC_PROTECT_ENV(scope);
+  int count = vars->count / 2;
+  int* slots = malloc(sizeof(int) * (count ? count : 1));
+  lval* x = NULL;
+  for (int i = 0; i < count && !x; i++) {
+    lval* v = lval_eval_expr(e, vars->cell[i * 2 + 1]);
+    if (LTYPE(v) == LVAL_ERR) {
+      x = v;
+    } else {
+      slots[i] = lloop_bind(scope, vars->cell[i * 2], v);
+      lval_del(v);
+    }
+  }
 
-  if (a->cell[0]->num) {
-    /* If condition is true, evaluate first expression */
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    /* Otherwise, evaluate second expression */
-    x = lval_eval(e, lval_pop(a, 2));
+  if (!x) {
+    if (lloop_count == lloop_cap) {
+      lloop_cap = lloop_cap ? lloop_cap * 2 : 16;
+      lloops = realloc(lloops, sizeof(lloop) * lloop_cap);
+    }
+    int l = lloop_count++;
+    lloops[l].scope = scope;
+    lloops[l].count = count;
+    lloops[l].slots = slots;
+
+    while (1) {
+      lloops[l].recur = 0;
+      x = lval_eval_list(scope, body);
+      if (!lloops[l].recur || LTYPE(x) == LVAL_ERR) { break; }
+      lval_del(x);
+#ifdef LISPY_GC
+      lgc_safepoint();
+#endif
+    }
+    lloop_count--;
   }
 
-  /* Delete argument list and return */
-  lval_del(a);
+  free(slots);
+  LGC_UNPROTECT_ENV(1);
+  lenv_leave(scope);
   return x;
 }
 
+/* Assign the variables of the innermost loop for its next iteration */
+lval* builtin_recur(lenv* e, int argc, lval** argv) {
+  LCHECK(lloop_count, "Function 'recur' called outside of 'loop'.");
+  lloop* l = &lloops[lloop_count - 1];
+  LCHECK_NUM_ARGS("recur", argc, l->count);
+
+  for (int i = 0; i < argc; i++) {
+    lloop_set(l->scope, l->slots[i], lval_copy(argv[i]));
+  }
+  l->recur = 1;
+  return lval_sexpr();
+}
+
 
 
 /* --- main program ---*/
 
 int main (int argc, char** argv) {
 
-  Number  = mpc_new("number");
-  Symbol  = mpc_new("symbol");
-  String  = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr   = mpc_new("sexpr");
-  Qexpr   = mpc_new("qexpr");
-  Expr    = mpc_new("expr");
-  Lispy   = mpc_new("lispy");
-
-
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                          \
-    number   : /-?[0-9]+/ ;                                    \
-    symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;              \
-    string   : /\"(\\\\.|[^\"])*\"/ ;                          \
-    comment  : /;[^\\r\\n]*/ ;                                 \
-    sexpr    : '(' <expr>* ')' ;                               \
-    qexpr    : '{' <expr>* '}' ;                               \
-    expr     : <number> | <symbol> | <string>                  \
-             | <comment> | <sexpr> | <qexpr> ;                 \
-    lispy    : /^/ <expr>* /$/ ;                               \
-    ",
-            Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
   /* Create empty environment and register builtin functions */
+  lsym_init();
+  lval_out = stdout;
   lenv* e = lenv_new();
+  lenv_global = e;
   lenv_add_builtins(e);
+#ifdef LISPY_GC
+  lgc_init(e);
+#endif
 
   /* Interactive prompt */
   if (argc == 1) {
@@ -1233,23 +6177,22 @@ int main (int argc, char** argv) {
       char* input = readline("lispy> ");
       add_history(input);
 
-      mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
-        //mpc_ast_print(r.output);
-
-        lval* x = lval_eval(e, lval_read(r.output));
-        //lval* x = lval_read(r.output);
+      lreader r;
+      lread_init(&r, "<stdin>", input);
+      lval* x = lread_all(&r);
+      if (LTYPE(x) != LVAL_ERR) {
+        x = lval_eval(e, x);
         lval_println(x);
-
-        lval_del(x);
-        mpc_ast_delete(r.output);
       } else {
         /* Otherwise print the error */
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
+        puts(x->err);
       }
+      lval_del(x);
 
       free(input);
+#ifdef LISPY_GC
+      lgc_safepoint();
+#endif
     }
   }
 
@@ -1259,22 +6202,29 @@ int main (int argc, char** argv) {
     /* Loop over ech supplied filename (starting from 1) */
     for (int i = 1; i < argc; i++) {
 
-      /* Argument list with a single argument, the filename */
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
+      /* A single argument, the filename */
+      lval* name = lval_str(argv[i]);
 
       /* Pass to builtin load and get the result */
-      lval* x = builtin_load(e, args);
+      LGC_PROTECT(name);
+      lval* x = builtin_load(e, 1, &name);
+      LGC_UNPROTECT(1);
+      lval_del(name);
 
       /* If the result is an error, be sure to print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (LTYPE(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
+#ifdef LISPY_GC
+      lgc_safepoint();
+#endif
     }
 
   }
 
   lenv_del(e);
-  mpc_cleanup(8,
-              Number, Symbol, String, Comment,
-              Sexpr, Qexpr, Expr, Lispy);
+#ifdef LISPY_GC
+  lgc_shutdown();
+#endif
+  lalloc_shutdown();
   return 0;
 }